@@ -17,10 +17,41 @@
 #include <ngx_string.h>
 
 int ngx_yy_sec_waf_unescape(ngx_str_t *str);
+u_char *ngx_yy_sec_waf_scan_escape(u_char *p, u_char *last);
+u_char *ngx_yy_sec_waf_scan_unicode(u_char *p, u_char *last);
+u_char *ngx_yy_sec_waf_scan_crlf(u_char *p, u_char *last);
+u_char *ngx_yy_sec_waf_normalize_path(u_char *dst, u_char *src, size_t len);
 
 u_char *ngx_yy_sec_waf_itoa(ngx_pool_t *p, ngx_int_t n);
 u_char *ngx_yy_sec_waf_uitoa(ngx_pool_t *p, ngx_uint_t n);
 
+/* one name/value pair of a collection, e.g. a query string argument */
+typedef struct {
+    ngx_str_t   key;
+    ngx_str_t   value;
+    ngx_uint_t  hash;    /* of the lowercased key, set when indexed */
+    ngx_uint_t  next;    /* 1 + index of the next element in its bucket, or 0 */
+} ngx_http_yy_sec_waf_elt_t;
+
+typedef struct {
+    ngx_array_t  elts;      /* ngx_http_yy_sec_waf_elt_t */
+
+    /* name index, built by the first lookup by name */
+    ngx_uint_t  *buckets;
+    ngx_uint_t   nbuckets;
+    ngx_uint_t   nindexed;
+
+    /* elements the body rules have seen, when they run once per buffer */
+    ngx_uint_t   checked;
+} ngx_http_yy_sec_waf_collection_t;
+
+ngx_http_yy_sec_waf_elt_t *ngx_yy_sec_waf_collection_push(ngx_pool_t *pool,
+    ngx_http_yy_sec_waf_collection_t *c, ngx_str_t *key, ngx_str_t *value);
+ngx_http_yy_sec_waf_elt_t *ngx_yy_sec_waf_collection_find(ngx_pool_t *pool,
+    ngx_http_yy_sec_waf_collection_t *c, ngx_str_t *key,
+    ngx_http_yy_sec_waf_elt_t *prev);
+void ngx_yy_sec_waf_collection_reset(ngx_http_yy_sec_waf_collection_t *c);
+
 #define REQUEST_HEADER_PHASE    1
 #define REQUEST_BODY_PHASE      2
 #define RESPONSE_HEADER_PHASE   4
@@ -29,6 +60,30 @@ u_char *ngx_yy_sec_waf_uitoa(ngx_pool_t *p, ngx_uint_t n);
 #define PROCESS_ARGS      1
 #define PROCESS_ARGS_POST 2
 
+#define BODY_TYPE_URLENCODED 1
+#define BODY_TYPE_MULTIPART  2
+#define BODY_TYPE_JSON       3
+#define BODY_TYPE_XML        4
+/* a known body which isn't parsed, e.g. an image */
+#define BODY_TYPE_NONE       5
+
+/* request body filters are there since nginx 1.8 */
+#if (nginx_version >= 1008000)
+#define YY_SEC_WAF_REQUEST_BODY_FILTER 1
+#endif
+
+/* request data a variable depends on, collected from the rules at config time */
+#define VAR_NEED_ARGS                 1
+/* the variable is about the request body, which is read for it */
+#define VAR_NEED_BODY                 2
+#define VAR_NEED_MULTIPART_PARTS      4
+#define VAR_NEED_MULTIPART_FILE_TYPE  8
+#define VAR_NEED_ARGS_HASH            16
+#define VAR_NEED_RESPONSE_BODY        32
+
+/* bytes of a response buffer kept to match what spans it and the next one */
+#define RESPONSE_BODY_OVERLAP  64
+
 extern ngx_module_t ngx_http_yy_sec_waf_module;
 
 extern ngx_atomic_t	  *request_matched;
@@ -36,6 +91,13 @@ extern ngx_atomic_t	  *request_blocked;
 extern ngx_atomic_t	  *request_allowed;
 extern ngx_atomic_t	  *request_logged;
 
+/* one target of a rule, either an nginx variable or a collection */
+typedef struct {
+    ngx_int_t   index;       /* nginx variable index, if no collection */
+    void       *collection;  /* re_collection_metadata */
+    ngx_str_t   key;         /* COLLECTION:key, empty for all elements */
+} ngx_http_yy_sec_waf_rule_var_t;
+
 typedef struct ngx_http_yy_sec_waf_rule {
     ngx_str_t *str; /* STR */
     ngx_http_regex_t *regex; /* REG */
@@ -46,8 +108,8 @@ typedef struct ngx_http_yy_sec_waf_rule {
     ngx_int_t  rule_id;
     ngx_int_t  phase;
 
-    /*target variable index array*/
-    ngx_array_t  var_index;
+    /* target variables, ngx_http_yy_sec_waf_rule_var_t */
+    ngx_array_t  vars;
 
     /* operators*/
     ngx_flag_t op_negative;
@@ -62,6 +124,37 @@ typedef struct ngx_http_yy_sec_waf_rule {
     ngx_flag_t     is_chain;
 } ngx_http_yy_sec_waf_rule_t;
 
+#define UPLOAD_EXTENSION_ALLOW     0
+#define UPLOAD_EXTENSION_DENY      1
+#define UPLOAD_CONTENT_TYPE_ALLOW  2
+#define UPLOAD_CONTENT_TYPE_DENY   3
+
+/* longest extension or content type of the upload_filter tables */
+#define UPLOAD_KEY_MAX             128
+
+/* the tables of upload_filter, by UPLOAD_*, a NULL table isn't checked */
+typedef struct {
+    ngx_array_t  *keys[4];  /* ngx_hash_key_t */
+    ngx_hash_t    hash[4];
+    ngx_flag_t    ready;
+} ngx_http_yy_sec_waf_upload_filter_t;
+
+/* longest media type of the body_type registry */
+#define BODY_TYPE_KEY_MAX          128
+
+/* media type -> BODY_TYPE_*, the default ones and those of body_type */
+typedef struct {
+    ngx_array_t  *keys;  /* ngx_hash_key_t */
+    ngx_hash_t    hash;
+    ngx_flag_t    ready;
+} ngx_http_yy_sec_waf_body_types_t;
+
+/* the inspection window of the bodies of a content type */
+typedef struct {
+    ngx_str_t  type;
+    size_t     limit;
+} ngx_http_yy_sec_waf_inspect_limit_t;
+
 typedef struct {
     /* ngx_http_yy_sec_waf_rule_t */
     ngx_array_t *request_header_rules;
@@ -75,8 +168,50 @@ typedef struct {
     ngx_flag_t enabled;
     ngx_flag_t conn_processor;
     ngx_flag_t body_processor;
+    ngx_flag_t body_streaming;
+    /* the parser of the body, by media type */
+    ngx_http_yy_sec_waf_body_types_t *body_types;
+    /* bytes of a body in a temp file to inspect, 0 to skip such bodies */
+    size_t     body_file_inspect_size;
+    /* limits of a gzip or deflate body, once inflated */
+    size_t     body_inflate_max_size;
+    ngx_uint_t body_inflate_max_ratio;
+    /* bytes of a body the rules inspect, 0 for the whole body */
+    size_t     body_inspect_limit;
+    /* ngx_http_yy_sec_waf_inspect_limit_t, by content type */
+    ngx_array_t *body_inspect_limit_types;
+    /* bytes of the body of a multipart part the rules inspect */
+    size_t     multipart_part_inspect_size;
+    /* the extensions and the content types of uploaded files */
+    ngx_http_yy_sec_waf_upload_filter_t *upload_filter;
+    /* limits of the arguments of the query string and the body, 0 for none */
+    ngx_uint_t args_max_count;
+    size_t     args_max_name_length;
+    size_t     args_max_value_length;
+    size_t     args_max_total_length;
+
+    /* there are rules which run once the body is read */
+    ngx_flag_t body_needed;
+
+    /* VAR_NEED_* of the variables used by the rules of this location */
+    ngx_uint_t var_flags;
 } ngx_http_yy_sec_waf_loc_conf_t;
 
+/* state of the multipart parser, see ngx_yy_sec_waf_body_processor.c */
+typedef struct ngx_http_yy_sec_waf_multipart_s ngx_http_yy_sec_waf_multipart_t;
+
+/* state of the json parser, see ngx_yy_sec_waf_body_json.c */
+typedef struct ngx_http_yy_sec_waf_json_s ngx_http_yy_sec_waf_json_t;
+
+/* state of the xml parser, see ngx_yy_sec_waf_body_xml.c */
+typedef struct ngx_http_yy_sec_waf_xml_s ngx_http_yy_sec_waf_xml_t;
+
+/* buckets of the argument names, see ngx_yy_sec_waf_body_processor.c */
+typedef struct ngx_http_yy_sec_waf_args_hash_s ngx_http_yy_sec_waf_args_hash_t;
+
+/* state of the body inflater, see ngx_yy_sec_waf_body_processor.c */
+typedef struct ngx_http_yy_sec_waf_inflate_s ngx_http_yy_sec_waf_inflate_t;
+
 typedef struct {
     ngx_http_request_t *r;
     ngx_pool_t *pool;
@@ -85,27 +220,63 @@ typedef struct {
 
     ngx_rbtree_t cache_rbtree;
     ngx_rbtree_node_t cache_sentinel;
+    /* bumped when a buffer the collections refer to may be reused */
+    ngx_uint_t   tfn_generation;
+
+    /* ARGS holds the elements of both ARGS_GET and ARGS_POST */
+    ngx_http_yy_sec_waf_collection_t args;
+    ngx_http_yy_sec_waf_collection_t args_get;
+    ngx_http_yy_sec_waf_collection_t args_post;
+
+    ngx_str_t  path_normalized;
 
-    ngx_str_t  args;
+    /* cookie name -> value, parsed on demand */
+    ngx_http_yy_sec_waf_collection_t cookies;
+    /* header name -> value, collected on demand */
+    ngx_http_yy_sec_waf_collection_t headers;
 
-    ngx_str_t  post_args;
     ngx_uint_t post_args_count;
+    /* bytes of the names and the values in ARGS */
+    size_t     args_total_length;
+    /* the most argument names in one bucket of a php, java or python hash */
+    ngx_http_yy_sec_waf_args_hash_t *args_hash;
+    ngx_uint_t args_hash_collisions;
 
     ngx_str_t  *real_client_ip;
     ngx_str_t  *server_ip;
 
-    u_char     *boundary;
-    ngx_uint_t  boundary_len;
-    ngx_array_t multipart_filename;
-    ngx_array_t multipart_name;
+    ngx_uint_t  body_type;
+    ngx_http_yy_sec_waf_multipart_t *multipart_parser;
+    ngx_http_yy_sec_waf_json_t      *json_parser;
+    ngx_http_yy_sec_waf_xml_t       *xml_parser;
+    ngx_http_yy_sec_waf_inflate_t   *body_inflate;
+    /* incomplete argument at the end of an urlencoded body buffer */
+    ngx_str_t   body_pending;
+    size_t      body_pending_size;
+    /* the inspection window of the body, 0 for the whole body */
+    size_t      body_limit;
+    size_t      body_inspected;
+    /* part name -> filename, empty if the part is no file */
+    ngx_http_yy_sec_waf_collection_t multipart;
+    /* the headers of the parts, and part name -> body of the part */
+    ngx_http_yy_sec_waf_collection_t multipart_part_headers;
+    ngx_http_yy_sec_waf_collection_t multipart_part_body;
+    /* part name -> type of the file, by its first bytes */
+    ngx_http_yy_sec_waf_collection_t multipart_file_type;
     ngx_array_t content_type;
 
+    /* the response buffer being sent, and its seam with the former one */
+    ngx_http_yy_sec_waf_collection_t response_body;
+    u_char     *response_seam;
+    size_t      response_tail;
+
     ngx_int_t  process_body_error;
     ngx_str_t  process_body_error_msg;
     ngx_uint_t post_args_len;
     ngx_uint_t conn_per_ip;
     ngx_int_t  var_index;
     ngx_str_t  var;
+    u_char     var_buf[NGX_INT_T_LEN];
 
     /* level flags*/
     ngx_flag_t    action_level;
@@ -115,6 +286,14 @@ typedef struct {
     ngx_flag_t    process_done:1;
     ngx_flag_t    read_body_done:1;
     ngx_flag_t    waiting_more_body:1;
+    ngx_flag_t    body_streaming:1;
+    ngx_flag_t    body_truncated:1;
+    ngx_flag_t    header_matched:1;
+    ngx_flag_t    path_normalized_done:1;
+    ngx_flag_t    args_done:1;
+    ngx_flag_t    cookies_done:1;
+    ngx_flag_t    headers_done:1;
+    ngx_flag_t    response_body_done:1;
 
     ngx_flag_t    matched:1;
     ngx_int_t     rule_id;
@@ -130,6 +309,43 @@ ngx_shm_zone_t *ngx_http_yy_sec_waf_create_shm_zone(ngx_conf_t *cf);
 ngx_int_t ngx_http_yy_sec_waf_process_body(ngx_http_request_t *r,
     ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx);
 
+ngx_int_t ngx_http_yy_sec_waf_body_init(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx);
+
+ngx_int_t ngx_http_yy_sec_waf_body_feed(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_chain_t *in);
+
+void ngx_http_yy_sec_waf_body_checked(ngx_http_request_ctx_t *ctx);
+
+ngx_int_t ngx_http_yy_sec_waf_json_init(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx);
+
+ngx_int_t ngx_http_yy_sec_waf_json_feed(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, u_char *p, u_char *last);
+
+ngx_int_t ngx_http_yy_sec_waf_json_finish(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx);
+
+ngx_int_t ngx_http_yy_sec_waf_xml_init(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx);
+
+ngx_int_t ngx_http_yy_sec_waf_xml_feed(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, u_char *p, u_char *last);
+
+ngx_int_t ngx_http_yy_sec_waf_xml_finish(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx);
+
+ngx_int_t ngx_http_yy_sec_waf_magic_init(ngx_conf_t *cf);
+
+ngx_int_t ngx_http_yy_sec_waf_magic_sniff(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_str_t *name, u_char *p, u_char *last);
+
+char *ngx_http_yy_sec_waf_args_limit(ngx_http_request_ctx_t *ctx,
+    ngx_str_t *name, ngx_str_t *value);
+
+ngx_int_t ngx_http_yy_sec_waf_process_args(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx);
+
 ngx_int_t ngx_http_yy_sec_waf_process_spliturl(ngx_http_request_t *r,
     ngx_str_t *str, ngx_http_request_ctx_t *ctx, ngx_int_t flag);
 
@@ -0,0 +1,598 @@
+/*
+** @file: ngx_yy_sec_waf_body_json.c
+** @description: This is the json body parser for yy sec waf.
+** @author: dw_liqi1<liqi1@yy.com>
+** @date: 2026.10.18
+** Copyright (C) YY, Inc.
+*/
+
+#include "ngx_yy_sec_waf.h"
+
+#define JSON_DEPTH_MAX    64
+#define JSON_PATH_MAX     1024
+#define JSON_LITERAL_MAX  256
+
+struct ngx_http_yy_sec_waf_json_s {
+    ngx_uint_t  state;
+
+    /* '{' or '[' of each open level, and the path length outside of it */
+    ngx_uint_t  depth;
+    u_char      container[JSON_DEPTH_MAX];
+    size_t      base[JSON_DEPTH_MAX];
+
+    /* the keys leading to the current value, joined with '.' */
+    u_char      path[JSON_PATH_MAX];
+    size_t      path_len;
+    /* copy of the path, shared by the values of an array */
+    ngx_str_t   name;
+
+    /* the string or literal being read, it may span buffers */
+    u_char     *buf;
+    size_t      len;
+    size_t      size;
+
+    /* a \u escape being read */
+    ngx_uint_t  unicode;
+    ngx_uint_t  hex;
+
+    unsigned    key:1;
+};
+
+enum {
+    json_sw_value = 0,
+    json_sw_value_first,
+    json_sw_key,
+    json_sw_key_first,
+    json_sw_colon,
+    json_sw_after,
+    json_sw_string,
+    json_sw_escape,
+    json_sw_unicode,
+    json_sw_literal,
+    json_sw_done,
+    json_sw_error
+};
+
+/*
+** @description: This function is called to record an error of the json
+** body, the parser ignores the rest of the body.
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_http_yy_sec_waf_json_t *js
+** @para: char *msg
+** @return: NGX_ERROR.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_json_error(ngx_http_request_ctx_t *ctx,
+    ngx_http_yy_sec_waf_json_t *js, char *msg)
+{
+    js->state = json_sw_error;
+
+    ctx->process_body_error = 1;
+    ctx->process_body_error_msg.data = (u_char *) msg;
+    ctx->process_body_error_msg.len = ngx_strlen(msg);
+
+    return NGX_ERROR;
+}
+
+/*
+** @description: This function is called to append to the string or the
+** literal being read. The buffer is reused by the next token.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_json_t *js
+** @para: u_char *p
+** @para: size_t n
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_json_append(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_json_t *js, u_char *p, size_t n)
+{
+    u_char *buf;
+    size_t  size;
+
+    if (js->len + n > js->size) {
+        size = ngx_max(2 * js->size, js->len + n);
+        size = ngx_max(size, 64);
+
+        buf = ngx_pnalloc(r->pool, size);
+        if (buf == NULL)
+            return NGX_ERROR;
+
+        ngx_memcpy(buf, js->buf, js->len);
+
+        js->buf = buf;
+        js->size = size;
+    }
+
+    ngx_memcpy(js->buf + js->len, p, n);
+    js->len += n;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to add a value to ARGS and
+** ARGS_POST, named by the keys leading to it.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_http_yy_sec_waf_json_t *js
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_json_value(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_http_yy_sec_waf_json_t *js)
+{
+    char     *msg;
+    ngx_str_t value;
+
+    if (js->name.data == NULL) {
+        js->name.len = js->path_len;
+        js->name.data = ngx_pnalloc(r->pool, js->path_len + 1);
+        if (js->name.data == NULL)
+            return NGX_ERROR;
+
+        ngx_memcpy(js->name.data, js->path, js->path_len);
+        js->name.data[js->path_len] = '\0';
+    }
+
+    value.len = js->len;
+
+    msg = ngx_http_yy_sec_waf_args_limit(ctx, &js->name, &value);
+    if (msg != NULL)
+        return ngx_http_yy_sec_waf_json_error(ctx, js, msg);
+
+    value.data = ngx_pnalloc(r->pool, js->len + 1);
+    if (value.data == NULL)
+        return NGX_ERROR;
+
+    ngx_memcpy(value.data, js->buf, js->len);
+    value.data[js->len] = '\0';
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] name=%V, value=%V", &js->name, &value);
+
+    if (ngx_yy_sec_waf_collection_push(r->pool, &ctx->args_post, &js->name, &value) == NULL
+        || ngx_yy_sec_waf_collection_push(r->pool, &ctx->args, &js->name, &value) == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ctx->post_args_count = ctx->args_post.elts.nelts;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called when a key is read, to make it
+** the last name of the path.
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_http_yy_sec_waf_json_t *js
+** @return: NGX_OK or NGX_ERROR if the path is too long.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_json_key(ngx_http_request_ctx_t *ctx,
+    ngx_http_yy_sec_waf_json_t *js)
+{
+    size_t len;
+
+    len = js->base[js->depth - 1];
+
+    if (len + 1 + js->len > JSON_PATH_MAX)
+        return ngx_http_yy_sec_waf_json_error(ctx, js, "UNCOMMON_JSON_FORMAT");
+
+    if (len)
+        js->path[len++] = '.';
+
+    ngx_memcpy(js->path + len, js->buf, js->len);
+    js->path_len = len + js->len;
+
+    ngx_str_null(&js->name);
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called when a literal ends, to check it
+** and to add numbers and booleans to the arguments.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_http_yy_sec_waf_json_t *js
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_json_literal(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_http_yy_sec_waf_json_t *js)
+{
+    if (js->len == 4 && !ngx_strncmp(js->buf, "null", 4))
+        return NGX_OK;
+
+    if (!(js->len == 4 && !ngx_strncmp(js->buf, "true", 4))
+        && !(js->len == 5 && !ngx_strncmp(js->buf, "false", 5))
+        && js->buf[0] != '-' && (js->buf[0] < '0' || js->buf[0] > '9'))
+    {
+        return ngx_http_yy_sec_waf_json_error(ctx, js, "UNCOMMON_JSON_FORMAT");
+    }
+
+    return ngx_http_yy_sec_waf_json_value(r, ctx, js);
+}
+
+/*
+** @description: This function is called to start parsing a json body.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_json_init(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx)
+{
+    ngx_http_yy_sec_waf_json_t *js;
+
+    js = ngx_pcalloc(r->pool, sizeof(ngx_http_yy_sec_waf_json_t));
+    if (js == NULL)
+        return NGX_ERROR;
+
+    js->state = json_sw_value;
+
+    ctx->json_parser = js;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to feed a buffer of the body to the
+** json parser. The body is read in one pass, the parser keeps its state
+** between the buffers, and the values are added to ARGS and ARGS_POST.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: u_char *p
+** @para: u_char *last
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_json_feed(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, u_char *p, u_char *last)
+{
+    u_char                      *q, ch, utf8[3];
+    size_t                       n;
+    ngx_http_yy_sec_waf_json_t  *js;
+
+    js = ctx->json_parser;
+
+    while (p < last) {
+
+        ch = *p;
+
+        switch (js->state) {
+
+        case json_sw_value_first:
+
+            if (ch == ']')
+                goto close;
+
+            /* fall through */
+
+        case json_sw_value:
+
+            switch (ch) {
+            case ' ': case '\t': case '\r': case '\n':
+                p++;
+                break;
+
+            case '{':
+            case '[':
+                if (js->depth == JSON_DEPTH_MAX)
+                    return ngx_http_yy_sec_waf_json_error(ctx, js, "UNCOMMON_JSON_DEPTH");
+
+                js->container[js->depth] = ch;
+                js->base[js->depth] = js->path_len;
+                js->depth++;
+
+                js->state = (ch == '{')? json_sw_key_first: json_sw_value_first;
+                p++;
+                break;
+
+            case '"':
+                js->key = 0;
+                js->len = 0;
+                js->state = json_sw_string;
+                p++;
+                break;
+
+            default:
+                if (ch != '-' && (ch < '0' || ch > '9')
+                    && ch != 't' && ch != 'f' && ch != 'n')
+                {
+                    return ngx_http_yy_sec_waf_json_error(ctx, js, "UNCOMMON_JSON_FORMAT");
+                }
+
+                js->len = 0;
+                js->state = json_sw_literal;
+                break;
+            }
+
+            break;
+
+        case json_sw_key_first:
+
+            if (ch == '}')
+                goto close;
+
+            /* fall through */
+
+        case json_sw_key:
+
+            switch (ch) {
+            case ' ': case '\t': case '\r': case '\n':
+                p++;
+                break;
+
+            case '"':
+                js->key = 1;
+                js->len = 0;
+                js->state = json_sw_string;
+                p++;
+                break;
+
+            default:
+                return ngx_http_yy_sec_waf_json_error(ctx, js, "UNCOMMON_JSON_FORMAT");
+            }
+
+            break;
+
+        case json_sw_colon:
+
+            switch (ch) {
+            case ' ': case '\t': case '\r': case '\n':
+                p++;
+                break;
+
+            case ':':
+                js->state = json_sw_value;
+                p++;
+                break;
+
+            default:
+                return ngx_http_yy_sec_waf_json_error(ctx, js, "UNCOMMON_JSON_FORMAT");
+            }
+
+            break;
+
+        case json_sw_after:
+
+            switch (ch) {
+            case ' ': case '\t': case '\r': case '\n':
+                p++;
+                break;
+
+            case ',':
+                js->state = (js->container[js->depth - 1] == '{')?
+                            json_sw_key: json_sw_value;
+                p++;
+                break;
+
+            case '}':
+            case ']':
+                goto close;
+
+            default:
+                return ngx_http_yy_sec_waf_json_error(ctx, js, "UNCOMMON_JSON_FORMAT");
+            }
+
+            break;
+
+        case json_sw_string:
+
+            /* the bytes up to a quote or an escape are copied at once */
+            for (q = p; q < last && *q != '"' && *q != '\\'; q++) {
+                /* void */
+            }
+
+            if (q > p && ngx_http_yy_sec_waf_json_append(r, js, p, q - p) != NGX_OK)
+                return NGX_ERROR;
+
+            p = q;
+
+            if (p == last)
+                break;
+
+            p++;
+
+            if (*q == '\\') {
+                js->state = json_sw_escape;
+                break;
+            }
+
+            if (js->key) {
+                if (ngx_http_yy_sec_waf_json_key(ctx, js) != NGX_OK)
+                    return NGX_ERROR;
+
+                js->state = json_sw_colon;
+                break;
+            }
+
+            if (ngx_http_yy_sec_waf_json_value(r, ctx, js) != NGX_OK)
+                return NGX_ERROR;
+
+            goto value_done;
+
+        case json_sw_escape:
+
+            switch (ch) {
+            case '"': case '\\': case '/':
+                break;
+            case 'b':
+                ch = '\b';
+                break;
+            case 'f':
+                ch = '\f';
+                break;
+            case 'n':
+                ch = '\n';
+                break;
+            case 'r':
+                ch = '\r';
+                break;
+            case 't':
+                ch = '\t';
+                break;
+            case 'u':
+                js->unicode = 0;
+                js->hex = 0;
+                js->state = json_sw_unicode;
+                p++;
+                continue;
+            default:
+                return ngx_http_yy_sec_waf_json_error(ctx, js, "UNCOMMON_JSON_FORMAT");
+            }
+
+            if (ngx_http_yy_sec_waf_json_append(r, js, &ch, 1) != NGX_OK)
+                return NGX_ERROR;
+
+            js->state = json_sw_string;
+            p++;
+            break;
+
+        case json_sw_unicode:
+
+            if (ch >= '0' && ch <= '9') {
+                js->unicode = js->unicode * 16 + (ch - '0');
+            } else if ((ch | 0x20) >= 'a' && (ch | 0x20) <= 'f') {
+                js->unicode = js->unicode * 16 + ((ch | 0x20) - 'a' + 10);
+            } else {
+                return ngx_http_yy_sec_waf_json_error(ctx, js, "UNCOMMON_JSON_FORMAT");
+            }
+
+            p++;
+
+            if (++js->hex < 4)
+                break;
+
+            if (js->unicode == 0)
+                return ngx_http_yy_sec_waf_json_error(ctx, js, "UNCOMMON_HEX_ENCODING");
+
+            /* each code unit is encoded as UTF-8 */
+            if (js->unicode < 0x80) {
+                utf8[0] = (u_char) js->unicode;
+                n = 1;
+            } else if (js->unicode < 0x800) {
+                utf8[0] = (u_char) (0xc0 | (js->unicode >> 6));
+                utf8[1] = (u_char) (0x80 | (js->unicode & 0x3f));
+                n = 2;
+            } else {
+                utf8[0] = (u_char) (0xe0 | (js->unicode >> 12));
+                utf8[1] = (u_char) (0x80 | ((js->unicode >> 6) & 0x3f));
+                utf8[2] = (u_char) (0x80 | (js->unicode & 0x3f));
+                n = 3;
+            }
+
+            if (ngx_http_yy_sec_waf_json_append(r, js, utf8, n) != NGX_OK)
+                return NGX_ERROR;
+
+            js->state = json_sw_string;
+            break;
+
+        case json_sw_literal:
+
+            for (q = p; q < last; q++) {
+                ch = *q;
+
+                if ((ch < '0' || ch > '9') && (ch < 'a' || ch > 'z')
+                    && (ch < 'A' || ch > 'Z') && ch != '-' && ch != '+' && ch != '.')
+                {
+                    break;
+                }
+            }
+
+            if (js->len + (q - p) > JSON_LITERAL_MAX)
+                return ngx_http_yy_sec_waf_json_error(ctx, js, "UNCOMMON_JSON_FORMAT");
+
+            if (q > p && ngx_http_yy_sec_waf_json_append(r, js, p, q - p) != NGX_OK)
+                return NGX_ERROR;
+
+            p = q;
+
+            if (p == last)
+                break;
+
+            /* the byte after the literal is looked at in the next state */
+            if (ngx_http_yy_sec_waf_json_literal(r, ctx, js) != NGX_OK)
+                return NGX_ERROR;
+
+            goto value_done;
+
+        case json_sw_done:
+
+            if (ch != ' ' && ch != '\t' && ch != '\r' && ch != '\n')
+                return ngx_http_yy_sec_waf_json_error(ctx, js, "UNCOMMON_JSON_FORMAT");
+
+            p++;
+            break;
+
+        default:
+            return NGX_ERROR;
+        }
+
+        continue;
+
+    close:
+
+        if (js->depth == 0
+            || js->container[js->depth - 1] != (ch == '}'? '{': '['))
+        {
+            return ngx_http_yy_sec_waf_json_error(ctx, js, "UNCOMMON_JSON_FORMAT");
+        }
+
+        js->depth--;
+        p++;
+
+        if (js->path_len != js->base[js->depth]) {
+            js->path_len = js->base[js->depth];
+            ngx_str_null(&js->name);
+        }
+
+    value_done:
+
+        js->state = js->depth? json_sw_after: json_sw_done;
+    }
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called at the end of a json body.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: NGX_OK or NGX_ERROR if the body is incomplete.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_json_finish(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx)
+{
+    ngx_http_yy_sec_waf_json_t *js;
+
+    js = ctx->json_parser;
+
+    if (js->state == json_sw_error)
+        return NGX_ERROR;
+
+    /* a number at the top level ends with the body */
+    if (js->state == json_sw_literal) {
+        if (ngx_http_yy_sec_waf_json_literal(r, ctx, js) != NGX_OK)
+            return NGX_ERROR;
+
+        js->state = json_sw_done;
+    }
+
+    if (js->state != json_sw_done)
+        return ngx_http_yy_sec_waf_json_error(ctx, js, "UNCOMMON_JSON_FORMAT");
+
+    return NGX_OK;
+}
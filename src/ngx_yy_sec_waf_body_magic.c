@@ -0,0 +1,276 @@
+/*
+** @file: ngx_yy_sec_waf_body_magic.c
+** @description: This is the file type sniffer of the multipart file parts
+** for yy sec waf.
+** @author: dw_liqi1<liqi1@yy.com>
+** @date: 2026.10.18
+** Copyright (C) YY, Inc.
+*/
+
+#include "ngx_yy_sec_waf.h"
+
+enum {
+    MAGIC_NONE = 0,
+    MAGIC_ELF,
+    MAGIC_PE,
+    MAGIC_MACHO,
+    MAGIC_JAVA,
+    MAGIC_SCRIPT,
+    MAGIC_ZIP,
+    MAGIC_GZIP,
+    MAGIC_RAR,
+    MAGIC_7Z,
+    MAGIC_OLE,
+    MAGIC_PDF,
+    MAGIC_GIF,
+    MAGIC_PNG,
+    MAGIC_JPEG,
+    MAGIC_PHP,
+    MAGIC_ASP,
+    MAGIC_HTML,
+    MAGIC_SVG,
+    MAGIC_MAX
+};
+
+/* the values of MULTIPART_FILE_TYPE, by MAGIC_* */
+static ngx_str_t  magic_types[] = {
+    ngx_null_string,
+    ngx_string("elf"),
+    ngx_string("pe"),
+    ngx_string("macho"),
+    ngx_string("java"),
+    ngx_string("script"),
+    ngx_string("zip"),
+    ngx_string("gzip"),
+    ngx_string("rar"),
+    ngx_string("7z"),
+    ngx_string("ole"),
+    ngx_string("pdf"),
+    ngx_string("gif"),
+    ngx_string("png"),
+    ngx_string("jpeg"),
+    ngx_string("php"),
+    ngx_string("asp"),
+    ngx_string("html"),
+    ngx_string("svg")
+};
+
+typedef struct {
+    ngx_str_t   bytes;
+    ngx_uint_t  type;
+    /* 0 at the start of the file, 1 at any '<' in it, in lowercase */
+    ngx_uint_t  tag;
+} ngx_http_yy_sec_waf_magic_sig_t;
+
+static ngx_http_yy_sec_waf_magic_sig_t  magic_signatures[] = {
+    { ngx_string("\x7f" "ELF"), MAGIC_ELF, 0 },
+    { ngx_string("MZ"), MAGIC_PE, 0 },
+    { ngx_string("\xfe\xed\xfa\xce"), MAGIC_MACHO, 0 },
+    { ngx_string("\xfe\xed\xfa\xcf"), MAGIC_MACHO, 0 },
+    { ngx_string("\xce\xfa\xed\xfe"), MAGIC_MACHO, 0 },
+    { ngx_string("\xcf\xfa\xed\xfe"), MAGIC_MACHO, 0 },
+    { ngx_string("\xca\xfe\xba\xbe"), MAGIC_JAVA, 0 },
+    { ngx_string("#!"), MAGIC_SCRIPT, 0 },
+    { ngx_string("PK\x03\x04"), MAGIC_ZIP, 0 },
+    { ngx_string("PK\x05\x06"), MAGIC_ZIP, 0 },
+    { ngx_string("\x1f\x8b"), MAGIC_GZIP, 0 },
+    { ngx_string("Rar!\x1a\x07"), MAGIC_RAR, 0 },
+    { ngx_string("7z\xbc\xaf\x27\x1c"), MAGIC_7Z, 0 },
+    { ngx_string("\xd0\xcf\x11\xe0\xa1\xb1\x1a\xe1"), MAGIC_OLE, 0 },
+    { ngx_string("%PDF-"), MAGIC_PDF, 0 },
+    { ngx_string("GIF87a"), MAGIC_GIF, 0 },
+    { ngx_string("GIF89a"), MAGIC_GIF, 0 },
+    { ngx_string("\x89PNG\r\n\x1a\n"), MAGIC_PNG, 0 },
+    { ngx_string("\xff\xd8\xff"), MAGIC_JPEG, 0 },
+
+    /* code hidden in the first bytes of e.g. an image is found too */
+    { ngx_string("<?php"), MAGIC_PHP, 1 },
+    { ngx_string("<?="), MAGIC_PHP, 1 },
+    { ngx_string("<%"), MAGIC_ASP, 1 },
+    { ngx_string("<html"), MAGIC_HTML, 1 },
+    { ngx_string("<!doctype html"), MAGIC_HTML, 1 },
+    { ngx_string("<script"), MAGIC_HTML, 1 },
+    { ngx_string("<iframe"), MAGIC_HTML, 1 },
+    { ngx_string("<svg"), MAGIC_SVG, 1 },
+
+    { ngx_null_string, 0, 0 }
+};
+
+/*
+** A node of the trie, its children are a list linked by sibling. Node 0
+** is the root of the signatures at the start of the file, node 1 the one
+** of the tags.
+*/
+typedef struct {
+    u_char    byte;
+    u_char    type;
+    uint16_t  child;
+    uint16_t  sibling;
+} ngx_http_yy_sec_waf_magic_node_t;
+
+static ngx_http_yy_sec_waf_magic_node_t  *magic_trie;
+
+/*
+** @description: This function is called to find the child of a node of
+** the trie for a byte.
+** @para: ngx_uint_t node
+** @para: u_char byte
+** @return: the child or 0 if not found.
+*/
+
+static ngx_uint_t
+ngx_http_yy_sec_waf_magic_child(ngx_uint_t node, u_char byte)
+{
+    ngx_uint_t n;
+
+    for (n = magic_trie[node].child; n; n = magic_trie[n].sibling) {
+        if (magic_trie[n].byte == byte)
+            return n;
+    }
+
+    return 0;
+}
+
+/*
+** @description: This function is called to build the signature trie, once
+** the configuration is read.
+** @para: ngx_conf_t *cf
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_magic_init(ngx_conf_t *cf)
+{
+    u_char                           *p, byte;
+    ngx_uint_t                        node, child;
+    ngx_array_t                       nodes;
+    ngx_http_yy_sec_waf_magic_sig_t  *sig;
+    ngx_http_yy_sec_waf_magic_node_t *n;
+
+    if (ngx_array_init(&nodes, cf->pool, 256,
+                       sizeof(ngx_http_yy_sec_waf_magic_node_t)) != NGX_OK)
+        return NGX_ERROR;
+
+    /* the two roots */
+    n = ngx_array_push_n(&nodes, 2);
+    if (n == NULL)
+        return NGX_ERROR;
+
+    ngx_memzero(n, 2 * sizeof(ngx_http_yy_sec_waf_magic_node_t));
+
+    for (sig = magic_signatures; sig->bytes.len; sig++) {
+        node = sig->tag;
+        magic_trie = nodes.elts;
+
+        for (p = sig->bytes.data; p < sig->bytes.data + sig->bytes.len; p++) {
+            byte = sig->tag? ngx_tolower(*p): *p;
+
+            child = ngx_http_yy_sec_waf_magic_child(node, byte);
+
+            if (child == 0) {
+                n = ngx_array_push(&nodes);
+                if (n == NULL)
+                    return NGX_ERROR;
+
+                magic_trie = nodes.elts;
+                child = nodes.nelts - 1;
+
+                n->byte = byte;
+                n->type = MAGIC_NONE;
+                n->child = 0;
+                n->sibling = magic_trie[node].child;
+                magic_trie[node].child = (uint16_t) child;
+            }
+
+            node = child;
+        }
+
+        magic_trie[node].type = (u_char) sig->type;
+    }
+
+    magic_trie = nodes.elts;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to match the signatures of a root
+** of the trie at p.
+** @para: ngx_uint_t root
+** @para: u_char *p
+** @para: u_char *last
+** @return: MAGIC_* of the longest signature matched, or MAGIC_NONE.
+*/
+
+static ngx_uint_t
+ngx_http_yy_sec_waf_magic_match(ngx_uint_t root, u_char *p, u_char *last)
+{
+    ngx_uint_t node, type;
+
+    node = root;
+    type = MAGIC_NONE;
+
+    for ( /* void */ ; p < last; p++) {
+        node = ngx_http_yy_sec_waf_magic_child(node, root? ngx_tolower(*p): *p);
+        if (node == 0)
+            break;
+
+        if (magic_trie[node].type != MAGIC_NONE)
+            type = magic_trie[node].type;
+    }
+
+    return type;
+}
+
+/*
+** @description: This function is called to find the types of a file part
+** by its first bytes, and to add them to MULTIPART_FILE_TYPE. A file may
+** have several types, e.g. a gif with php in it.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_str_t *name, the name of the part.
+** @para: u_char *p
+** @para: u_char *last
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_magic_sniff(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_str_t *name, u_char *p, u_char *last)
+{
+    u_char     *q;
+    ngx_uint_t  type, found;
+
+    if (magic_trie == NULL)
+        return NGX_OK;
+
+    found = 0;
+
+    type = ngx_http_yy_sec_waf_magic_match(0, p, last);
+    if (type != MAGIC_NONE)
+        found |= 1 << type;
+
+    for (q = p; q < last; q++) {
+        q = ngx_strlchr(q, last, '<');
+        if (q == NULL)
+            break;
+
+        type = ngx_http_yy_sec_waf_magic_match(1, q, last);
+        if (type != MAGIC_NONE)
+            found |= 1 << type;
+    }
+
+    for (type = MAGIC_NONE + 1; type < MAGIC_MAX; type++) {
+        if (!(found & (1 << type)))
+            continue;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "[ysec_waf] part [%V] looks like %V", name, &magic_types[type]);
+
+        if (ngx_yy_sec_waf_collection_push(r->pool, &ctx->multipart_file_type,
+                                           name, &magic_types[type]) == NULL)
+            return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
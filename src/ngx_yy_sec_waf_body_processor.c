@@ -8,12 +8,200 @@
 
 #include "ngx_yy_sec_waf.h"
 
+#if (NGX_ZLIB)
+#include <zlib.h>
+#endif
+
+/*
+** @description: This function is called to decode a name or a value of
+** an argument. Clean data is left in place, only escaped data is copied.
+** @para: ngx_http_request_t *r
+** @para: ngx_str_t *str
+** @return: NGX_OK, NGX_DECLINED on null bytes or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_decode_arg(ngx_http_request_t *r, ngx_str_t *str)
+{
+    u_char *p;
+
+    if (ngx_yy_sec_waf_scan_escape(str->data, str->data + str->len)
+        == str->data + str->len)
+    {
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, str->len);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(p, str->data, str->len);
+    str->data = p;
+
+    if (ngx_yy_sec_waf_unescape(str) > 0) {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+/* buckets of the modelled hash tables, a power of 2 */
+#define ARGS_HASH_BUCKETS  512
+
+/*
+** The buckets the argument names fall into in the hash tables of php
+** (DJBX33A), java (String.hashCode in a HashMap) and python 2 (string
+** hash in a dict), all of a fixed size. Crafted names pile into one bucket
+** and turn the table into a list, under any limit on the count.
+*/
+struct ngx_http_yy_sec_waf_args_hash_s {
+    uint16_t    php[ARGS_HASH_BUCKETS];
+    uint16_t    java[ARGS_HASH_BUCKETS];
+    uint16_t    python[ARGS_HASH_BUCKETS];
+
+    /* the last name, a name repeated for an array is the same key */
+    ngx_str_t   last;
+    ngx_str_t   last_php;
+};
+
+/*
+** @description: This function is called to add one to a bucket, and to
+** keep the fullest bucket in ctx->args_hash_collisions.
+** @para: ngx_http_request_ctx_t *ctx
+** @para: uint16_t *bucket
+** @return: void
+*/
+
+static void
+ngx_http_yy_sec_waf_args_hash_add(ngx_http_request_ctx_t *ctx, uint16_t *bucket)
+{
+    if (*bucket < 0xffff)
+        (*bucket)++;
+
+    if (*bucket > ctx->args_hash_collisions)
+        ctx->args_hash_collisions = *bucket;
+}
+
+/*
+** @description: This function is called to add an argument name to the
+** buckets of the php, java and python hash tables.
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_str_t *name
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_args_hash(ngx_http_request_ctx_t *ctx, ngx_str_t *name)
+{
+    u_char                          *p, *last;
+    uint32_t                         java;
+    uint64_t                         php, python;
+    ngx_str_t                        key;
+    ngx_http_yy_sec_waf_args_hash_t *ah;
+
+    ah = ctx->args_hash;
+
+    if (ah == NULL) {
+        ah = ngx_pcalloc(ctx->pool, sizeof(ngx_http_yy_sec_waf_args_hash_t));
+        if (ah == NULL)
+            return NGX_ERROR;
+
+        ctx->args_hash = ah;
+    }
+
+    last = name->data + name->len;
+
+    /* php keeps a[x] under a */
+    key.data = name->data;
+    key.len = name->len;
+
+    p = ngx_strlchr(name->data, last, '[');
+    if (p != NULL && p > name->data)
+        key.len = p - name->data;
+
+    if (key.len != ah->last_php.len
+        || ngx_memcmp(key.data, ah->last_php.data, key.len) != 0)
+    {
+        php = 5381;
+        for (p = key.data; p < key.data + key.len; p++)
+            php = php * 33 + *p;
+
+        ngx_http_yy_sec_waf_args_hash_add(ctx,
+            &ah->php[php & (ARGS_HASH_BUCKETS - 1)]);
+
+        ah->last_php = key;
+    }
+
+    if (name->len == ah->last.len
+        && ngx_memcmp(name->data, ah->last.data, name->len) == 0)
+        return NGX_OK;
+
+    java = 0;
+    python = name->len? (uint64_t) name->data[0] << 7: 0;
+
+    for (p = name->data; p < last; p++) {
+        java = java * 31 + *p;
+        python = (python * 1000003) ^ *p;
+    }
+
+    python ^= name->len;
+    java ^= java >> 16;
+
+    ngx_http_yy_sec_waf_args_hash_add(ctx, &ah->java[java & (ARGS_HASH_BUCKETS - 1)]);
+    ngx_http_yy_sec_waf_args_hash_add(ctx, &ah->python[python & (ARGS_HASH_BUCKETS - 1)]);
+
+    ah->last = *name;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called before an argument is added to
+** ARGS, to check it against the args_max_* limits of the location. The
+** parser stops at the first argument over a limit. The name is added to
+** the buckets of ARGS_HASH_COLLISIONS too, if a rule looks at it.
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_str_t *name
+** @para: ngx_str_t *value
+** @return: the error message, or NULL if the argument is within the limits.
+*/
+
+char *
+ngx_http_yy_sec_waf_args_limit(ngx_http_request_ctx_t *ctx,
+    ngx_str_t *name, ngx_str_t *value)
+{
+    ngx_http_yy_sec_waf_loc_conf_t *cf = ctx->cf;
+
+    if ((cf->var_flags & VAR_NEED_ARGS_HASH)
+        && ngx_http_yy_sec_waf_args_hash(ctx, name) != NGX_OK)
+        return "UNCOMMON_ARGS_HASH";
+
+    if (cf->args_max_count && ctx->args.elts.nelts >= cf->args_max_count)
+        return "UNCOMMON_ARGS_COUNT";
+
+    if (cf->args_max_name_length && name->len > cf->args_max_name_length)
+        return "UNCOMMON_ARG_NAME_LENGTH";
+
+    if (cf->args_max_value_length && value->len > cf->args_max_value_length)
+        return "UNCOMMON_ARG_VALUE_LENGTH";
+
+    ctx->args_total_length += name->len + value->len;
+
+    if (cf->args_max_total_length
+        && ctx->args_total_length > cf->args_max_total_length)
+        return "UNCOMMON_ARGS_LENGTH";
+
+    return NULL;
+}
+
 /*
 ** @description: This function is called to process spliturl of the request.
+** The arguments are added to ARGS and to ARGS_GET or ARGS_POST.
 ** @para: ngx_http_request_t *r
 ** @para: ngx_str_t *str
-** @para: ngx_array_t *rules
 ** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_int_t flag
 ** @return: NGX_OK or NGX_ERROR if failed.
 */
 
@@ -21,100 +209,184 @@ ngx_int_t
 ngx_http_yy_sec_waf_process_spliturl(ngx_http_request_t *r,
     ngx_str_t *str, ngx_http_request_ctx_t *ctx, ngx_int_t flag)
 {
-    u_char    *start, *buffer, *eq, *ev;
-    ngx_uint_t len, arg_cnt, arg_len, nullbytes, buffer_size;
-    ngx_str_t  value;
+    u_char                           *start, *end, *eq, *last;
+    char                             *msg;
+    ngx_int_t                         rc;
+    ngx_str_t                         name, value;
+    ngx_http_yy_sec_waf_collection_t *args;
 
     ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] data=%p", str->data);
 
-    buffer = start = str->data;
-    len =  str->len;
-    buffer_size = arg_len = 0;
+    args = (flag == PROCESS_ARGS_POST)? &ctx->args_post: &ctx->args_get;
+
+    start = str->data;
+    last = str->data + str->len;
 
-    if (len != 0)
-        arg_cnt = 1;
+    while (start < last) {
+        end = ngx_strlchr(start, last, '&');
+        if (end == NULL) {
+            end = last;
+        }
 
-    while ((start < str->data + len) && *start) {
-        if (*start == '&') {
-            ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] start=%p, buffer=%p", start, buffer);
-            buffer_size++;
-            *buffer++ = '$';
-            arg_cnt++;
+        if (end == start) {
             start++;
             continue;
         }
 
-        eq = (u_char*)ngx_strlchr((u_char*)start, (u_char*)str->data + len, '=');
-        ev = (u_char*)ngx_strlchr((u_char*)start, (u_char*)str->data + len, '&');
+        /* an argument without '=' has an empty value */
+        eq = ngx_strlchr(start, end, '=');
 
-        if (eq) {
-            if (!ev)
-                ev = str->data + str->len;
-            arg_len = ev - start;
-            eq = ngx_strlchr(start, start+arg_len, '=');
-            if (!eq)
-                return NGX_ERROR;
+        name.data = start;
+        name.len = (eq? eq: end) - start;
+        value.data = eq? eq + 1: end;
+        value.len = end - value.data;
 
-            eq++;
-            value.data = eq;
-            value.len = ev - eq;
-        } else {
-            break;
+        rc = ngx_http_yy_sec_waf_decode_arg(r, &name);
+        if (rc == NGX_OK) {
+            rc = ngx_http_yy_sec_waf_decode_arg(r, &value);
         }
 
-        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] value=%V, len=%d", &value, value.len);
-
-        nullbytes = ngx_yy_sec_waf_unescape(&value);
+        if (rc == NGX_DECLINED) {
+            ctx->process_body_error = 1;
+            ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_HEX_ENCODING");
+            return NGX_ERROR;
+        }
 
-        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] value=%V, nullbytes=%d", &value, nullbytes);
+        if (rc != NGX_OK) {
+            return NGX_ERROR;
+        }
 
-        if (nullbytes > 0) {
+        msg = ngx_http_yy_sec_waf_args_limit(ctx, &name, &value);
+        if (msg != NULL) {
             ctx->process_body_error = 1;
-            ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_HEX_ENCODING");
+            ctx->process_body_error_msg.data = (u_char *) msg;
+            ctx->process_body_error_msg.len = ngx_strlen(msg);
             return NGX_ERROR;
         }
 
-        buffer = ngx_cpymem(buffer, value.data, value.len);
-        buffer_size += value.len;
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] name=%V, value=%V", &name, &value);
 
-        start += arg_len;
+        if (ngx_yy_sec_waf_collection_push(r->pool, args, &name, &value) == NULL
+            || ngx_yy_sec_waf_collection_push(r->pool, &ctx->args, &name, &value) == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        start = end + 1;
     }
 
-    str->len = buffer_size;
+    if (flag == PROCESS_ARGS_POST) {
+        ctx->post_args_count = args->elts.nelts;
+    }
+	
+    return NGX_OK;
+}
 
-    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] str=%V", str);
 
-    /* convert \r\n to blank as '  ' to improve the format of error log */
-    buffer = str->data;
+/*
+** @description: This function is called to parse the query string of the request.
+** It runs at most once, the first time a variable needs the args.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
 
-    while (buffer_size-- > 0) {
-        if (*buffer == '\n' || *buffer == '\r')
-            *buffer = ' ';
-        buffer++;
+ngx_int_t
+ngx_http_yy_sec_waf_process_args(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx)
+{
+    if (ctx->args_done) {
+        return NGX_OK;
     }
 
-    if (flag == PROCESS_ARGS_POST) {
+    ctx->args_done = 1;
 
-        ctx->post_args.len = str->len;
-        ctx->post_args.data = ngx_palloc(r->pool, str->len);
-        if (ctx->post_args.data == NULL) {
-            return NGX_ERROR;
-        }
-    
-        ngx_memcpy(ctx->post_args.data, str->data, str->len);
-        ctx->post_args_count = arg_cnt;
-        ctx->post_args_len = str->len;
+    if (r->args.len == 0) {
+        return NGX_OK;
     }
-	
-    return NGX_OK;
+
+    /* the arguments refer to r->args, which is left as it is */
+    return ngx_http_yy_sec_waf_process_spliturl(r, &r->args, ctx, PROCESS_ARGS);
 }
 
+#define MULTIPART_BOUNDARY_MAX    70
+#define MULTIPART_HEADER_MAX      1024
+/* bytes at the start of a file part its type is told by */
+#define MULTIPART_MAGIC_MAX       512
+
+struct ngx_http_yy_sec_waf_multipart_s {
+    ngx_uint_t  state;
+
+    /* "\r\n--" and the boundary */
+    u_char      delimiter[4 + MULTIPART_BOUNDARY_MAX];
+    size_t      delimiter_len;
+    /* bytes of the delimiter matched at the end of the last buffer */
+    size_t      matched;
+
+    /* the header line being read, it may span buffers */
+    u_char      header[MULTIPART_HEADER_MAX];
+    size_t      header_len;
+
+    /* the part whose headers are being read */
+    ngx_str_t   name;
+    ngx_str_t   filename;
+    ngx_str_t   content_type;
+    unsigned    disposition:1;
+    unsigned    file:1;
+
+    /* the rules look at the headers and the bodies of the parts */
+    unsigned    parts:1;
+
+    /* the body of the part being read, up to multipart_part_inspect_size */
+    ngx_str_t   part;
+    /* bytes allocated for the body, 0 if it is left in the buffer */
+    size_t      part_size;
+
+    /* the first bytes of the file part being read, for its type */
+    u_char      magic[MULTIPART_MAGIC_MAX];
+    size_t      magic_len;
+    unsigned    sniff:1;
+    unsigned    sniffed:1;
+};
+
+enum {
+    multipart_sw_preamble = 0,
+    multipart_sw_delimiter,
+    multipart_sw_delimiter_lf,
+    multipart_sw_close,
+    multipart_sw_header,
+    multipart_sw_body,
+    multipart_sw_epilogue,
+    multipart_sw_error
+};
+
+/*
+** @description: This function is called to record an error of the multipart
+** body, the parser ignores the rest of the body.
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_http_yy_sec_waf_multipart_t *mp
+** @para: char *msg
+** @return: NGX_ERROR.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_multipart_error(ngx_http_request_ctx_t *ctx,
+    ngx_http_yy_sec_waf_multipart_t *mp, char *msg)
+{
+    mp->state = multipart_sw_error;
+
+    ctx->process_body_error = 1;
+    ctx->process_body_error_msg.data = (u_char *) msg;
+    ctx->process_body_error_msg.len = ngx_strlen(msg);
+
+    return NGX_ERROR;
+}
 
 /*
 ** @description: This function is called to process the boundary of the request.
 ** @para: ngx_http_request_t *r
-** @para: ngx_http_request_ctx_t *ctx
-** @para: ngx_str_t full_body
+** @para: u_char **boundary
+** @para: ngx_uint_t *boundary_len
 ** @return: NGX_OK or NGX_ERROR if failed.
 */
 
@@ -125,335 +397,1531 @@ ngx_http_yy_sec_waf_process_boundary(ngx_http_request_t *r,
     u_char *start;
     u_char *end;
 
-    start = r->headers_in.content_type->value.data + ngx_strlen("multipart/form-data;");
+    start = r->headers_in.content_type->value.data;
     end = r->headers_in.content_type->value.data + r->headers_in.content_type->value.len;
 
+    /* the parameters, after the media type */
+    start = ngx_strlchr(start, end, ';');
+    if (start == NULL)
+        return NGX_ERROR;
+
+    start++;
+
     while (start < end && *start && (*start == ' ' || *start == '\t'))
         start++;
 
-    if (ngx_strncmp(start, "boundary=", ngx_strlen("boundary=")))
+    if (end - start < (ssize_t) ngx_strlen("boundary=")
+        || ngx_strncasecmp(start, (u_char *) "boundary=", ngx_strlen("boundary=")))
         return NGX_ERROR;
 
     start += ngx_strlen("boundary=");
 
+    if (start < end && *start == '"') {
+        start++;
+        end = ngx_strlchr(start, end, '"');
+        if (end == NULL)
+            return NGX_ERROR;
+    }
+
     *boundary_len = end - start;
     *boundary = start;
 
-    if (*boundary_len > 70)
+    if (*boundary_len == 0 || *boundary_len > MULTIPART_BOUNDARY_MAX)
         return NGX_ERROR;
 
     return NGX_OK;
 }
 
 /*
-** @description: This function is called to process the disposition of the request.
+** @description: This function is called to copy a header value of a part,
+** as the header line buffer is reused for the next line.
 ** @para: ngx_http_request_t *r
-** @para: ngx_http_request_ctx_t *ctx
-** @para: ngx_str_t full_body
+** @para: ngx_str_t *dst
+** @para: u_char *start
+** @para: u_char *end
 ** @return: NGX_OK or NGX_ERROR if failed.
 */
 
+static ngx_int_t
+ngx_http_yy_sec_waf_multipart_copy(ngx_http_request_t *r,
+    ngx_str_t *dst, u_char *start, u_char *end)
+{
+    dst->len = end - start;
+    dst->data = ngx_pnalloc(r->pool, dst->len + 1);
+    if (dst->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(dst->data, start, dst->len);
+    dst->data[dst->len] = '\0';
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to process the disposition of a part,
+** the value of its content-disposition header.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_multipart_t *mp
+** @para: u_char *p
+** @para: u_char *last
+** @return: NGX_OK, NGX_DECLINED if malformed or NGX_ERROR if failed.
+*/
+
 static ngx_int_t
 ngx_http_yy_sec_waf_process_disposition(ngx_http_request_t *r,
-    u_char *str, u_char *line_end, ngx_str_t *name, ngx_str_t *filename)
+    ngx_http_yy_sec_waf_multipart_t *mp, u_char *p, u_char *last)
 {
-    u_char *name_start, *name_end, *filename_start, *filename_end;
+    u_char    *start;
+    ngx_str_t  key;
+    ngx_int_t  rc;
+
+    while (p < last && (*p == ' ' || *p == '\t'))
+        p++;
 
-    while (str < line_end) {
-        while(str < line_end && *str && (*str == ' ' || *str == '\t'))
-            str++;
-        if (str < line_end && *str && *str == ';')
-            str++;
-        while (str < line_end && *str && (*str == ' ' || *str == '\t'))
-            str++;
+    if (last - p < (ssize_t) ngx_strlen("form-data")
+        || ngx_strncasecmp(p, (u_char *) "form-data", ngx_strlen("form-data")))
+        return NGX_DECLINED;
 
-        if (str >= line_end || !*str)
+    p += ngx_strlen("form-data");
+
+    while (p < last) {
+        while (p < last && (*p == ' ' || *p == '\t'))
+            p++;
+
+        if (p == last)
             break;
 
-        if (!ngx_strncmp(str, "name=\"", ngx_strlen("name=\""))) {
-            name_start = name_end = str + ngx_strlen("name=\"");
-            do {
-                name_end = (u_char*) ngx_strchr(name_end, '"');
-                if (name_end && *(name_end - 1) != '\\')
-                    break;
-                name_end++;
-            } while (name_end && name_end < line_end);
+        if (*p++ != ';')
+            return NGX_DECLINED;
 
-            if (!name_end || !*name_end)
-                return NGX_ERROR;
+        while (p < last && (*p == ' ' || *p == '\t'))
+            p++;
 
-            str = name_end;
+        key.data = p;
+        while (p < last && *p != '=' && *p != ';' && *p != ' ' && *p != '\t')
+            p++;
+        key.len = p - key.data;
 
-            if (str < line_end + 1)
-                str++;
-            else
-                return NGX_ERROR;
+        while (p < last && (*p == ' ' || *p == '\t'))
+            p++;
+
+        /* a parameter without value */
+        if (p == last || *p != '=')
+            continue;
+
+        p++;
+
+        while (p < last && (*p == ' ' || *p == '\t'))
+            p++;
+
+        if (p < last && *p == '"') {
+            start = ++p;
+
+            /* ignore 0x00 for %00 injection situation */
+            while (p < last && (*p != '"' || p[-1] == '\\'))
+                p++;
+
+            if (p == last)
+                return NGX_DECLINED;
 
-            name->data = name_start;
-            name->len = name_end - name_start;
+        } else {
+            start = p;
+
+            while (p < last && *p != ';' && *p != ' ' && *p != '\t')
+                p++;
         }
-        else if (!ngx_strncmp(str, "filename=\"", ngx_strlen("filename=\""))) {
-            filename_end = filename_start = str + ngx_strlen("filename=\"");
-            do {
-                /* ignore 0x00 for %00 injection situation */
-                filename_end = (u_char*) ngx_strlchr(filename_end, line_end, '"');
-                if (filename_end && *(filename_end - 1) != '\\')
-                    break;
-                filename_end++;
-            } while (filename_end && filename_end < line_end);
 
-            if (!filename_end)
-                return NGX_ERROR;
+        rc = NGX_OK;
 
-            str = filename_end;
-            if (str < line_end + 1)
-                str++;
-            else
-                return NGX_ERROR;
+        if (key.len == ngx_strlen("name")
+            && !ngx_strncasecmp(key.data, (u_char *) "name", key.len))
+        {
+            rc = ngx_http_yy_sec_waf_multipart_copy(r, &mp->name, start, p);
 
-            filename->data = filename_start;
-            filename->len = filename_end - filename_start;
+        } else if (key.len == ngx_strlen("filename")
+            && !ngx_strncasecmp(key.data, (u_char *) "filename", key.len))
+        {
+            rc = ngx_http_yy_sec_waf_multipart_copy(r, &mp->filename, start, p);
+            mp->file = 1;
         }
-        else if (str == line_end - 1)
-            break;
-        else {
+
+        if (rc != NGX_OK)
             return NGX_ERROR;
-        }
+
+        if (p < last && *p == '"')
+            p++;
     }
 
-    if (filename_end > line_end || name_end > line_end)
-        return NGX_ERROR;
+    mp->disposition = 1;
 
     return NGX_OK;
 }
 
 /*
-** @description: This function is called to process the multipart of the request.
+** @description: This function is called to add a header of a part to
+** MULTIPART_PART_HEADERS. A line in a body buffer is referred to where it
+** is, unless the buffer may be reused once it is read.
 ** @para: ngx_http_request_t *r
 ** @para: ngx_http_request_ctx_t *ctx
-** @para: ngx_str_t full_body
+** @para: ngx_http_yy_sec_waf_multipart_t *mp
+** @para: u_char *p, the start of the line.
+** @para: u_char *last, the end of the line without CRLF.
 ** @return: NGX_OK or NGX_ERROR if failed.
 */
 
 static ngx_int_t
-ngx_http_yy_sec_waf_process_multipart(ngx_http_request_t *r,
-    ngx_str_t *full_body, ngx_http_request_ctx_t *ctx)
+ngx_http_yy_sec_waf_multipart_part_header(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_http_yy_sec_waf_multipart_t *mp,
+    u_char *p, u_char *last)
 {
-    u_char *boundary, *line_start, *line_end, *body_end, *p;
-    ngx_uint_t boundary_len, idx, nullbytes;
-    ngx_str_t name, filename, content_type, *tmp;
+    u_char    *colon, *end;
+    ngx_str_t  name, value;
 
-    boundary = NULL;
-    boundary_len = 0;
+    colon = ngx_strlchr(p, last, ':');
+    if (colon == NULL)
+        return NGX_OK;
 
-    if (r == NULL || full_body == NULL || ctx == NULL) {
-        return NGX_ERROR;
+    end = colon;
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+
+    name.data = p;
+    name.len = end - p;
+
+    p = colon + 1;
+    while (p < last && (*p == ' ' || *p == '\t'))
+        p++;
+
+    value.data = p;
+    value.len = last - p;
+
+    if (mp->header_len || ctx->body_streaming || ctx->body_inflate) {
+        if (ngx_http_yy_sec_waf_multipart_copy(r, &name, name.data,
+                                               name.data + name.len) != NGX_OK
+            || ngx_http_yy_sec_waf_multipart_copy(r, &value, value.data,
+                                                  value.data + value.len) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
     }
 
-    if (ngx_http_yy_sec_waf_process_boundary(r, &boundary, &boundary_len) != NGX_OK) {
-        ctx->process_body_error = 1;
-        ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_CONTENT_TYPE");
+    if (ngx_yy_sec_waf_collection_push(r->pool, &ctx->multipart_part_headers,
+                                       &name, &value) == NULL)
         return NGX_ERROR;
-    }
 
-    ctx->boundary = boundary;
-    ctx->boundary_len = boundary_len;
+    return NGX_OK;
+}
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] boundary: %s", boundary);
+/*
+** @description: This function is called to process a header line of a part.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_http_yy_sec_waf_multipart_t *mp
+** @para: u_char *p, the start of the line.
+** @para: u_char *last, the end of the line.
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
 
-    idx = 0;
+static ngx_int_t
+ngx_http_yy_sec_waf_multipart_header(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_http_yy_sec_waf_multipart_t *mp,
+    u_char *p, u_char *last)
+{
+    ngx_int_t  rc;
 
-    p = ngx_strlcasestrn(full_body->data, full_body->data+full_body->len, boundary, boundary_len-1);
-    if (p == NULL)
-        return NGX_ERROR;
+    if (last > p && last[-1] == '\r')
+        last--;
 
-    full_body->len = full_body->len - (p - full_body->data - 2);
-    full_body->data = p - 2;
+    if (mp->parts
+        && ngx_http_yy_sec_waf_multipart_part_header(r, ctx, mp, p, last) != NGX_OK)
+        return NGX_ERROR;
 
-    while (idx < full_body->len) {
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] request_body: %s, len: %d", full_body->data+idx, full_body->len);
+    if (last - p >= (ssize_t) ngx_strlen("content-disposition:")
+        && !ngx_strncasecmp(p, (u_char *) "content-disposition:",
+                            ngx_strlen("content-disposition:")))
+    {
+        rc = ngx_http_yy_sec_waf_process_disposition(r, mp,
+                 p + ngx_strlen("content-disposition:"), last);
 
-        if (idx+boundary_len+6 == full_body->len || idx+boundary_len+4 == full_body->len) {
-            if (ngx_strncmp(full_body->data+idx, "--", 2)
-                || ngx_strncmp(full_body->data+idx+2, boundary, boundary_len)
-                || ngx_strncmp(full_body->data+idx+boundary_len+2, "--", 2)) {
-                ctx->process_body_error = 1;
-                ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_POST_FORMAT");
-                return NGX_ERROR;
-            } else
-                break;
-        }
+        if (rc == NGX_DECLINED)
+            return ngx_http_yy_sec_waf_multipart_error(ctx, mp, "UNCOMMON_POST_FORMAT");
 
-        if ((full_body->len-idx < 4+boundary_len)
-            || full_body->data[idx] != '-'
-            || full_body->data[idx+1] != '-'
-            || ngx_strncmp(full_body->data+idx+2, boundary, boundary_len)
-            || idx+boundary_len+2+2 >= full_body->len
-            || full_body->data[idx+boundary_len+2] != '\r'
-            || full_body->data[idx+boundary_len+2+1] != '\n') {
-            ctx->process_body_error = 1;
-            ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_POST_BOUNDARY");
-            return NGX_ERROR;
-        }
+        return rc;
+    }
 
-        /* plus with 4 for -- and \r\n*/
-        idx += boundary_len + 4;
-        if (ngx_strncasecmp(full_body->data+idx, (u_char*)"content-disposition: form-data;",
-            ngx_strlen("content-disposition: form-data;"))) {
-            ctx->process_body_error = 1;
-            ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_POST_FORMAT");
-            return NGX_ERROR;
-        }
+    if (last - p >= (ssize_t) ngx_strlen("content-type:")
+        && !ngx_strncasecmp(p, (u_char *) "content-type:", ngx_strlen("content-type:")))
+    {
+        p += ngx_strlen("content-type:");
 
-        idx += ngx_strlen("content-disposition: form-data;");
+        while (p < last && (*p == ' ' || *p == '\t'))
+            p++;
 
-        /* ignore 0x00 for %00 injection situation */
-        line_end = (u_char*) ngx_strlchr(full_body->data+idx, full_body->data+full_body->len, '\n');
-        if (!line_end) {
-            ctx->process_body_error = 1;
-            ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_POST_FORMAT");
-            return NGX_ERROR;
-        }
+        return ngx_http_yy_sec_waf_multipart_copy(r, &mp->content_type, p, last);
+    }
 
-        ngx_memzero(&name, sizeof(ngx_str_t));
-        ngx_memzero(&filename, sizeof(ngx_str_t));
-        ngx_memzero(&content_type, sizeof(ngx_str_t));
+    return NGX_OK;
+}
 
-        ngx_http_yy_sec_waf_process_disposition(r, full_body->data+idx, line_end, &name, &filename);
+/*
+** @description: This function is called to check an extension or a content
+** type against the allow and the deny table of upload_filter.
+** @para: ngx_http_yy_sec_waf_upload_filter_t *uf
+** @para: ngx_uint_t table, UPLOAD_EXTENSION_ALLOW or UPLOAD_CONTENT_TYPE_ALLOW.
+** @para: u_char *p
+** @para: size_t len
+** @return: 1 if denied, 0 if not.
+*/
 
-        tmp = ngx_array_push(&ctx->multipart_filename);
-        if (tmp == NULL)
-            return NGX_ERROR;
+static ngx_uint_t
+ngx_http_yy_sec_waf_upload_denied(ngx_http_yy_sec_waf_upload_filter_t *uf,
+    ngx_uint_t table, u_char *p, size_t len)
+{
+    u_char      lowcase[UPLOAD_KEY_MAX];
+    ngx_uint_t  key;
 
-        ngx_memcpy(tmp, &filename, sizeof(ngx_str_t));
+    /* no extension, or one longer than any in the tables */
+    if (len == 0 || len > UPLOAD_KEY_MAX)
+        return uf->keys[table] != NULL;
 
-        tmp = ngx_array_push(&ctx->multipart_name);
-        if (tmp == NULL)
-            return NGX_ERROR;
+    key = ngx_hash_strlow(lowcase, p, len);
 
-        ngx_memcpy(tmp, &name, sizeof(ngx_str_t));
+    if (uf->keys[table]
+        && ngx_hash_find(&uf->hash[table], key, lowcase, len) == NULL)
+        return 1;
 
-        if (filename.data) {
-            line_start = line_end + 1;
-            line_end = (u_char*) ngx_strchr(line_start, '\n');
-            if (!line_end) {
-                ctx->process_body_error = 1;
-                ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_POST_FORMAT");
-                return NGX_ERROR;
-            }
+    if (uf->keys[table + 1]
+        && ngx_hash_find(&uf->hash[table + 1], key, lowcase, len) != NULL)
+        return 1;
 
-            content_type.data = line_start + ngx_strlen("content-type: ");
-            content_type.len = (line_end - 1) - content_type.data;
+    return 0;
+}
 
-            tmp = ngx_array_push(&ctx->content_type);
-            if (tmp == NULL)
-                return NGX_ERROR;
+/*
+** @description: This function is called to check the filename and the
+** content type of a file part against upload_filter. The extension is
+** what follows the last dot of the filename, without trailing dots and
+** spaces, which Windows drops when it saves the file.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_str_t *filename
+** @para: ngx_str_t *content_type
+** @return: the error message, or NULL if the file is allowed.
+*/
 
-            ngx_memcpy(tmp, &content_type, sizeof(ngx_str_t));
-        }
+static char *
+ngx_http_yy_sec_waf_upload_check(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_str_t *filename, ngx_str_t *content_type)
+{
+    u_char                              *p, *last, *end;
+    ngx_http_yy_sec_waf_upload_filter_t *uf;
 
-        idx += (u_char*)line_end - (full_body->data + idx) + 1;
-        if (full_body->data[idx] != '\r' || full_body->data[idx+1] != '\n') {
-            ctx->process_body_error = 1;
-            ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_POST_FORMAT");
-            return NGX_ERROR;
-        }
+    uf = ctx->cf->upload_filter;
 
-        idx += 2;
-        body_end = NULL;
-
-        while (idx < full_body->len) {
-            body_end = (u_char*) ngx_strstr(full_body->data+idx, "\r\n--");
-            while(!body_end) {
-                idx += ngx_strlen((const char*)full_body->data+idx);
-                if (idx < full_body->len-2) {
-                    idx++;
-                    body_end = (u_char*) ngx_strstr(full_body->data+idx, "\r\n--");
-                } else
-                    break;
-            }
+    if (uf == NULL)
+        return NULL;
 
-            if (!body_end) {
-                ctx->process_body_error = 1;
-                ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_POST_FORMAT");
-                return NGX_ERROR;
-            }
+    p = filename->data;
+    last = filename->data + filename->len;
 
-            if (!ngx_strncmp(body_end+4, boundary, boundary_len))
-                break;
-            else {
-                idx += (u_char*)body_end - (full_body->data + idx) + 1;
-                body_end = NULL;
-            }
-        }
+    while (last > p && (last[-1] == '.' || last[-1] == ' '))
+        last--;
 
-        if (!body_end) {
-            return NGX_ERROR;
-        }
+    for (end = last; end > p; end--) {
+        if (end[-1] == '.' || end[-1] == '/' || end[-1] == '\\')
+            break;
+    }
 
-        if (filename.data) {
-            nullbytes = ngx_yy_sec_waf_unescape(&filename);
-            if (nullbytes > 0) {
-                ctx->process_body_error = 1;
-                ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_HEX_ENCODING");
-                return NGX_ERROR;
-            }
+    if (end == p || end[-1] != '.')
+        end = last;
 
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "[ysec_waf] checking filename [%V]", &filename);
-
-            if (content_type.data) {
-                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                    "[ysec_waf] checking content_type [%V]", &content_type);
-
-                if (!ngx_strnstr(filename.data, ".html", filename.len)
-                    || !ngx_strnstr(filename.data, ".html", filename.len)) {
-                    if (!ngx_strncmp(content_type.data, "text/html", content_type.len)) {
-                        ctx->process_body_error = 1;
-                        ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_FILENAME");
-                        return NGX_ERROR;
-                    }
-                }
-                else if (!ngx_strnstr(filename.data, ".php", filename.len)
-                    || !ngx_strnstr(filename.data, ".jsp", filename.len)) {
-                    if (!ngx_strncmp(content_type.data, "application/octet-stream", content_type.len)) {
-                        ctx->process_body_error = 1;
-                        ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_FILENAME");
-                        return NGX_ERROR;
-                    }
-                }
-            }
+    if (ngx_http_yy_sec_waf_upload_denied(uf, UPLOAD_EXTENSION_ALLOW, end, last - end))
+        return "UNCOMMON_FILENAME";
 
-            idx += (u_char*)body_end - (full_body->data + idx);
-        } else if (name.data) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "[ysec_waf] checking name [%V]", &name);
+    p = content_type->data;
+    last = ngx_strlchr(p, p + content_type->len, ';');
+    if (last == NULL)
+        last = p + content_type->len;
 
-            idx += (u_char*)body_end - (full_body->data + idx);
-        }
+    while (last > p && (last[-1] == ' ' || last[-1] == '\t'))
+        last--;
 
-        if (!ngx_strncmp(body_end, "\r\n", ngx_strlen("\r\n")))
-            idx += ngx_strlen("\r\n");
-    }
+    if (ngx_http_yy_sec_waf_upload_denied(uf, UPLOAD_CONTENT_TYPE_ALLOW, p, last - p))
+        return "UNCOMMON_FILE_CONTENT_TYPE";
 
-    return NGX_OK;
+    return NULL;
 }
 
 /*
-** @description: This function is called to process the body of the request.
+** @description: This function is called when the headers of a part are
+** read, to check the filename and to add the part to ctx->multipart.
 ** @para: ngx_http_request_t *r
-** @para: ngx_http_yy_sec_waf_loc_conf_t *cf
 ** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_http_yy_sec_waf_multipart_t *mp
 ** @return: NGX_OK or NGX_ERROR if failed.
 */
 
-ngx_int_t
+static ngx_int_t
+ngx_http_yy_sec_waf_multipart_part(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_http_yy_sec_waf_multipart_t *mp)
+{
+    char      *msg;
+    ngx_uint_t nullbytes;
+    ngx_str_t  filename, content_type, *tmp;
+
+    if (!mp->disposition)
+        return ngx_http_yy_sec_waf_multipart_error(ctx, mp, "UNCOMMON_POST_FORMAT");
+
+    filename = mp->filename;
+    content_type = mp->content_type;
+
+    nullbytes = ngx_yy_sec_waf_unescape(&filename);
+
+    /* added before the checks, so that rules see rejected filenames too */
+    if (ngx_yy_sec_waf_collection_push(r->pool, &ctx->multipart,
+                                       &mp->name, &filename) == NULL)
+        return NGX_ERROR;
+
+    if (mp->file) {
+        if (nullbytes > 0)
+            return ngx_http_yy_sec_waf_multipart_error(ctx, mp, "UNCOMMON_HEX_ENCODING");
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "[ysec_waf] checking filename [%V]", &filename);
+
+        if (content_type.data) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "[ysec_waf] checking content_type [%V]", &content_type);
+
+            tmp = ngx_array_push(&ctx->content_type);
+            if (tmp == NULL)
+                return NGX_ERROR;
+
+            ngx_memcpy(tmp, &content_type, sizeof(ngx_str_t));
+        }
+
+        msg = ngx_http_yy_sec_waf_upload_check(r, ctx, &filename, &content_type);
+        if (msg != NULL)
+            return ngx_http_yy_sec_waf_multipart_error(ctx, mp, msg);
+    } else if (mp->name.data) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "[ysec_waf] checking name [%V]", &mp->name);
+    }
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to add the data of a part to its
+** body, up to multipart_part_inspect_size bytes, and the first bytes of a
+** file part to its magic. Data next to the last data
+** in the same buffer is left in place, the body is copied only if it
+** spans buffers or the buffers may be reused once they are read.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_http_yy_sec_waf_multipart_t *mp
+** @para: u_char *p
+** @para: u_char *last
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_multipart_data(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_http_yy_sec_waf_multipart_t *mp,
+    u_char *p, u_char *last)
+{
+    u_char *data;
+    size_t  n, size, max;
+
+    if (mp->state != multipart_sw_body)
+        return NGX_OK;
+
+    if (mp->sniff && mp->file && !mp->sniffed) {
+        n = ngx_min((size_t) (last - p), MULTIPART_MAGIC_MAX - mp->magic_len);
+
+        ngx_memcpy(mp->magic + mp->magic_len, p, n);
+        mp->magic_len += n;
+
+        if (mp->magic_len == MULTIPART_MAGIC_MAX) {
+            mp->sniffed = 1;
+
+            if (ngx_http_yy_sec_waf_magic_sniff(r, ctx, &mp->name, mp->magic,
+                    mp->magic + mp->magic_len) != NGX_OK)
+                return NGX_ERROR;
+        }
+    }
+
+    if (!mp->parts)
+        return NGX_OK;
+
+    max = ctx->cf->multipart_part_inspect_size;
+    n = ngx_min((size_t) (last - p), max - mp->part.len);
+
+    if (n == 0)
+        return NGX_OK;
+
+    if (mp->part_size == 0 && !ctx->body_streaming && !ctx->body_inflate
+        && (mp->part.len == 0 || mp->part.data + mp->part.len == p))
+    {
+        if (mp->part.len == 0)
+            mp->part.data = p;
+
+        mp->part.len += n;
+        return NGX_OK;
+    }
+
+    if (mp->part.len + n > mp->part_size) {
+        size = ngx_max(2 * mp->part_size, mp->part.len + n);
+        size = ngx_min(ngx_max(size, 256), max);
+
+        data = ngx_pnalloc(r->pool, size);
+        if (data == NULL)
+            return NGX_ERROR;
+
+        ngx_memcpy(data, mp->part.data, mp->part.len);
+
+        mp->part.data = data;
+        mp->part_size = size;
+    }
+
+    ngx_memcpy(mp->part.data + mp->part.len, p, n);
+    mp->part.len += n;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called at the delimiter after a part,
+** to add its body to MULTIPART_PART_BODY and the type of a file shorter
+** than its magic to MULTIPART_FILE_TYPE.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_http_yy_sec_waf_multipart_t *mp
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_multipart_part_end(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_http_yy_sec_waf_multipart_t *mp)
+{
+    if (mp->state != multipart_sw_body)
+        return NGX_OK;
+
+    if (mp->sniff && mp->file && !mp->sniffed
+        && ngx_http_yy_sec_waf_magic_sniff(r, ctx, &mp->name, mp->magic,
+               mp->magic + mp->magic_len) != NGX_OK)
+        return NGX_ERROR;
+
+    if (!mp->parts)
+        return NGX_OK;
+
+    if (ngx_yy_sec_waf_collection_push(r->pool, &ctx->multipart_part_body,
+                                       &mp->name, &mp->part) == NULL)
+        return NGX_ERROR;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to start parsing a multipart body.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_multipart_init(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx)
+{
+    u_char                          *boundary;
+    ngx_uint_t                       boundary_len;
+    ngx_http_yy_sec_waf_multipart_t *mp;
+
+    if (ngx_http_yy_sec_waf_process_boundary(r, &boundary, &boundary_len) != NGX_OK) {
+        ctx->process_body_error = 1;
+        ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_CONTENT_TYPE");
+        return NGX_ERROR;
+    }
+
+    mp = ngx_pcalloc(r->pool, sizeof(ngx_http_yy_sec_waf_multipart_t));
+    if (mp == NULL)
+        return NGX_ERROR;
+
+    ngx_memcpy(mp->delimiter, "\r\n--", 4);
+    ngx_memcpy(mp->delimiter + 4, boundary, boundary_len);
+    mp->delimiter_len = 4 + boundary_len;
+
+    mp->parts = (ctx->cf->var_flags & VAR_NEED_MULTIPART_PARTS)
+                && ctx->cf->multipart_part_inspect_size;
+    mp->sniff = (ctx->cf->var_flags & VAR_NEED_MULTIPART_FILE_TYPE) != 0;
+
+    /* the body may start with the first delimiter, without the CRLF */
+    mp->state = multipart_sw_preamble;
+    mp->matched = 2;
+
+    ctx->multipart_parser = mp;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+        "[ysec_waf] boundary: %*s", boundary_len, boundary);
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to feed a buffer of the body to the
+** multipart parser. The body is read in one pass, the parser keeps its
+** state between the buffers.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: u_char *p
+** @para: u_char *last
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_multipart_feed(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, u_char *p, u_char *last)
+{
+    u_char                          *q, *start, *end;
+    size_t                           n;
+    ngx_http_yy_sec_waf_multipart_t *mp;
+
+    mp = ctx->multipart_parser;
+
+    while (p < last) {
+
+        switch (mp->state) {
+
+        case multipart_sw_preamble:
+        case multipart_sw_body:
+
+            if (mp->matched) {
+                n = ngx_min(mp->delimiter_len - mp->matched, (size_t) (last - p));
+
+                if (ngx_memcmp(p, mp->delimiter + mp->matched, n) == 0) {
+                    p += n;
+                    mp->matched += n;
+
+                    if (mp->matched == mp->delimiter_len) {
+                        if (ngx_http_yy_sec_waf_multipart_part_end(r, ctx, mp) != NGX_OK)
+                            return NGX_ERROR;
+
+                        mp->matched = 0;
+                        mp->state = multipart_sw_delimiter;
+                    }
+
+                    break;
+                }
+
+                /*
+                ** the bytes held back were data, the byte at p is looked
+                ** at again since a delimiter has '\r' at its start only
+                */
+                if (ngx_http_yy_sec_waf_multipart_data(r, ctx, mp, mp->delimiter,
+                        mp->delimiter + mp->matched) != NGX_OK)
+                    return NGX_ERROR;
+
+                mp->matched = 0;
+            }
+
+            q = ngx_yy_sec_waf_scan_crlf(p, last);
+
+            if (q == last) {
+                if (ngx_http_yy_sec_waf_multipart_data(r, ctx, mp, p, last) != NGX_OK)
+                    return NGX_ERROR;
+
+                p = last;
+                break;
+            }
+
+            n = ngx_min(mp->delimiter_len, (size_t) (last - q));
+
+            if (ngx_memcmp(q, mp->delimiter, n) != 0) {
+                if (ngx_http_yy_sec_waf_multipart_data(r, ctx, mp, p, q + 1) != NGX_OK)
+                    return NGX_ERROR;
+
+                p = q + 1;
+                break;
+            }
+
+            if (ngx_http_yy_sec_waf_multipart_data(r, ctx, mp, p, q) != NGX_OK)
+                return NGX_ERROR;
+
+            if (n < mp->delimiter_len) {
+                mp->matched = n;
+                p = last;
+                break;
+            }
+
+            if (ngx_http_yy_sec_waf_multipart_part_end(r, ctx, mp) != NGX_OK)
+                return NGX_ERROR;
+
+            p = q + n;
+            mp->state = multipart_sw_delimiter;
+            break;
+
+        case multipart_sw_delimiter:
+
+            switch (*p++) {
+            case '-':
+                mp->state = multipart_sw_close;
+                break;
+            case ' ':
+            case '\t':
+                /* transport padding */
+                break;
+            case '\r':
+                mp->state = multipart_sw_delimiter_lf;
+                break;
+            case '\n':
+                goto header;
+            default:
+                return ngx_http_yy_sec_waf_multipart_error(ctx, mp, "UNCOMMON_POST_BOUNDARY");
+            }
+
+            break;
+
+        case multipart_sw_delimiter_lf:
+
+            if (*p++ != '\n')
+                return ngx_http_yy_sec_waf_multipart_error(ctx, mp, "UNCOMMON_POST_BOUNDARY");
+
+        header:
+
+            ngx_memzero(&mp->name, sizeof(ngx_str_t));
+            ngx_memzero(&mp->filename, sizeof(ngx_str_t));
+            ngx_memzero(&mp->content_type, sizeof(ngx_str_t));
+            ngx_str_null(&mp->part);
+            mp->part_size = 0;
+            mp->magic_len = 0;
+            mp->sniffed = 0;
+            mp->disposition = 0;
+            mp->file = 0;
+            mp->header_len = 0;
+
+            mp->state = multipart_sw_header;
+            break;
+
+        case multipart_sw_close:
+
+            if (*p++ != '-')
+                return ngx_http_yy_sec_waf_multipart_error(ctx, mp, "UNCOMMON_POST_BOUNDARY");
+
+            mp->state = multipart_sw_epilogue;
+            break;
+
+        case multipart_sw_header:
+
+            q = ngx_strlchr(p, last, '\n');
+
+            /* a line within the buffer is parsed where it is */
+            if (q && mp->header_len == 0 && q - p <= MULTIPART_HEADER_MAX) {
+                start = p;
+                end = q;
+
+            } else {
+                n = (q ? q : last) - p;
+
+                if (mp->header_len + n > MULTIPART_HEADER_MAX)
+                    return ngx_http_yy_sec_waf_multipart_error(ctx, mp, "UNCOMMON_POST_FORMAT");
+
+                ngx_memcpy(mp->header + mp->header_len, p, n);
+                mp->header_len += n;
+
+                if (q == NULL) {
+                    p = last;
+                    break;
+                }
+
+                start = mp->header;
+                end = mp->header + mp->header_len;
+            }
+
+            p = q + 1;
+
+            /* an empty line ends the headers of the part */
+            if (end == start || (end - start == 1 && *start == '\r')) {
+                if (ngx_http_yy_sec_waf_multipart_part(r, ctx, mp) != NGX_OK)
+                    return NGX_ERROR;
+
+                mp->state = multipart_sw_body;
+                break;
+            }
+
+            if (ngx_http_yy_sec_waf_multipart_header(r, ctx, mp, start, end) != NGX_OK)
+                return NGX_ERROR;
+
+            mp->header_len = 0;
+            break;
+
+        case multipart_sw_epilogue:
+            return NGX_OK;
+
+        default:
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called at the end of a multipart body.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: NGX_OK or NGX_ERROR if the body is incomplete.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_multipart_finish(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx)
+{
+    ngx_http_yy_sec_waf_multipart_t *mp;
+
+    mp = ctx->multipart_parser;
+
+    if (mp->state == multipart_sw_error)
+        return NGX_ERROR;
+
+    if (mp->state != multipart_sw_epilogue)
+        return ngx_http_yy_sec_waf_multipart_error(ctx, mp, "UNCOMMON_POST_FORMAT");
+
+    return NGX_OK;
+}
+
+/* longest argument of an urlencoded body when no args_max_* bounds it */
+#define URLENCODED_PENDING_MAX    (1024 * 1024)
+
+/*
+** @description: This function is called to keep the incomplete argument at
+** the end of an urlencoded body buffer, until the rest of it is read. The
+** argument is bounded by the args_max_* limits, or URLENCODED_PENDING_MAX.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: u_char *p
+** @para: u_char *last
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_body_pending(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, u_char *p, u_char *last)
+{
+    u_char                         *data;
+    size_t                          size, max;
+    ngx_http_yy_sec_waf_loc_conf_t *cf = ctx->cf;
+
+    max = URLENCODED_PENDING_MAX;
+
+    /* the limits are of unescaped bytes, "%XX" is one */
+    if (cf->args_max_name_length && cf->args_max_value_length)
+        max = ngx_min(max, 3 * (cf->args_max_name_length
+                                + cf->args_max_value_length) + 1);
+
+    if (cf->args_max_total_length)
+        max = ngx_min(max, 3 * cf->args_max_total_length + 1);
+
+    if (ctx->body_pending.len + (last - p) > max) {
+        ctx->process_body_error = 1;
+        ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_ARG_VALUE_LENGTH");
+        return NGX_ERROR;
+    }
+
+    if (ctx->body_pending.len + (last - p) > ctx->body_pending_size) {
+        size = ngx_max(2 * ctx->body_pending_size,
+                       ctx->body_pending.len + (last - p));
+        size = ngx_max(size, 256);
+        size = ngx_min(size, max);
+
+        data = ngx_pnalloc(r->pool, size);
+        if (data == NULL)
+            return NGX_ERROR;
+
+        if (ctx->body_pending.len)
+            ngx_memcpy(data, ctx->body_pending.data, ctx->body_pending.len);
+
+        ctx->body_pending.data = data;
+        ctx->body_pending_size = size;
+    }
+
+    ngx_memcpy(ctx->body_pending.data + ctx->body_pending.len, p, last - p);
+    ctx->body_pending.len += last - p;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to feed a buffer of an urlencoded
+** body. An argument split between two buffers is joined in body_pending,
+** the others are parsed in place. When the body is streamed or inflated,
+** the buffer may be reused once it is read, so the arguments are copied.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: u_char *p
+** @para: u_char *last
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_urlencoded_feed(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, u_char *p, u_char *last)
+{
+    u_char    *amp;
+    ngx_str_t  args;
+
+    ctx->post_args_len += last - p;
+
+    if (ctx->body_pending.len) {
+        amp = ngx_strlchr(p, last, '&');
+        if (amp == NULL)
+            return ngx_http_yy_sec_waf_body_pending(r, ctx, p, last);
+
+        if (ngx_http_yy_sec_waf_body_pending(r, ctx, p, amp) != NGX_OK)
+            return NGX_ERROR;
+
+        if (ngx_http_yy_sec_waf_process_spliturl(r, &ctx->body_pending,
+                                                 ctx, PROCESS_ARGS_POST) != NGX_OK)
+            return NGX_ERROR;
+
+        /* the parsed argument may point into it, don't reuse it */
+        ngx_str_null(&ctx->body_pending);
+        ctx->body_pending_size = 0;
+
+        p = amp + 1;
+    }
+
+    for (amp = last; amp > p; amp--) {
+        if (amp[-1] == '&')
+            break;
+    }
+
+    if (amp > p) {
+        args.data = p;
+        args.len = amp - p;
+
+        if (ctx->body_streaming || ctx->body_inflate) {
+            args.data = ngx_pnalloc(r->pool, args.len);
+            if (args.data == NULL)
+                return NGX_ERROR;
+
+            ngx_memcpy(args.data, p, args.len);
+        }
+
+        if (ngx_http_yy_sec_waf_process_spliturl(r, &args, ctx, PROCESS_ARGS_POST) != NGX_OK)
+            return NGX_ERROR;
+    }
+
+    if (amp == last)
+        return NGX_OK;
+
+    return ngx_http_yy_sec_waf_body_pending(r, ctx, amp, last);
+}
+
+/*
+** @description: This function is called to check the media type of the
+** body, which matches either type or a type with the given suffix.
+** @para: ngx_str_t *content_type
+** @para: char *type
+** @para: char *suffix, e.g. "+json", or NULL.
+** @return: 1 if matched, 0 if not.
+*/
+
+static ngx_uint_t
+ngx_http_yy_sec_waf_media_type(ngx_str_t *content_type, char *type, char *suffix)
+{
+    u_char *end;
+    size_t  len;
+
+    end = ngx_strlchr(content_type->data, content_type->data + content_type->len, ';');
+    if (end == NULL)
+        end = content_type->data + content_type->len;
+
+    while (end > content_type->data && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+
+    len = end - content_type->data;
+
+    if (len == ngx_strlen(type)
+        && !ngx_strncasecmp(content_type->data, (u_char *) type, len))
+    {
+        return 1;
+    }
+
+    return suffix && len > ngx_strlen(suffix)
+           && !ngx_strncasecmp(end - ngx_strlen(suffix), (u_char *) suffix,
+                               ngx_strlen(suffix));
+}
+
+/*
+** @description: This function is called to find the parser of the body in
+** the body_type registry, by the media type of the body or else by its
+** suffix, e.g. "+json" for application/vnd.api+json.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_body_types_t *bt
+** @return: BODY_TYPE_* or 0 if the media type isn't known.
+*/
+
+static ngx_uint_t
+ngx_http_yy_sec_waf_body_type(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_body_types_t *bt)
+{
+    u_char     *p, *end, lowcase[BODY_TYPE_KEY_MAX];
+    size_t      len;
+    void       *type;
+    ngx_str_t  *content_type;
+
+    if (bt == NULL || !bt->ready)
+        return 0;
+
+    content_type = &r->headers_in.content_type->value;
+
+    end = ngx_strlchr(content_type->data, content_type->data + content_type->len, ';');
+    if (end == NULL)
+        end = content_type->data + content_type->len;
+
+    while (end > content_type->data && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+
+    len = end - content_type->data;
+
+    if (len == 0 || len > BODY_TYPE_KEY_MAX)
+        return 0;
+
+    type = ngx_hash_find(&bt->hash, ngx_hash_strlow(lowcase, content_type->data, len),
+                         lowcase, len);
+    if (type)
+        return (ngx_uint_t) type;
+
+    for (p = lowcase + len - 1; p > lowcase && *p != '+'; p--) { /* void */ }
+
+    if (p == lowcase)
+        return 0;
+
+    len = lowcase + len - p;
+
+    return (ngx_uint_t) ngx_hash_find(&bt->hash, ngx_hash_key(p, len), p, len);
+}
+
+/*
+** @description: This function is called to find the inspection window of
+** the body, by its content type or else the one of the location.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_loc_conf_t *cf
+** @return: the number of bytes to inspect, 0 for the whole body.
+*/
+
+static size_t
+ngx_http_yy_sec_waf_body_limit(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf)
+{
+    ngx_uint_t                           i;
+    ngx_http_yy_sec_waf_inspect_limit_t *limit;
+
+    if (cf->body_inspect_limit_types == NULL)
+        return cf->body_inspect_limit;
+
+    limit = cf->body_inspect_limit_types->elts;
+
+    for (i = 0; i < cf->body_inspect_limit_types->nelts; i++) {
+        if (ngx_http_yy_sec_waf_media_type(&r->headers_in.content_type->value,
+                                           (char *) limit[i].type.data, NULL))
+            return limit[i].limit;
+    }
+
+    return cf->body_inspect_limit;
+}
+
+/*
+** @description: This function is called to find the Content-Encoding
+** header of the request.
+** @para: ngx_http_request_t *r
+** @return: the header or NULL if not found.
+*/
+
+static ngx_table_elt_t *
+ngx_http_yy_sec_waf_content_encoding(ngx_http_request_t *r)
+{
+    ngx_uint_t        i;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *h;
+
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL)
+                break;
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].key.len == ngx_strlen("Content-Encoding")
+            && !ngx_strncasecmp(h[i].key.data, (u_char *) "Content-Encoding",
+                                ngx_strlen("Content-Encoding")))
+        {
+            return &h[i];
+        }
+    }
+
+    return NULL;
+}
+
+#if (NGX_ZLIB)
+
+#define INFLATE_WINDOW_SIZE  16384
+
+struct ngx_http_yy_sec_waf_inflate_s {
+    z_stream    zstream;
+    /* the inflated bytes, fed to the parser of the body and reused */
+    u_char      out[INFLATE_WINDOW_SIZE];
+    unsigned    done:1;
+    unsigned    error:1;
+};
+
+static void *
+ngx_http_yy_sec_waf_inflate_alloc(void *opaque, u_int items, u_int size)
+{
+    return ngx_palloc(opaque, items * size);
+}
+
+static void
+ngx_http_yy_sec_waf_inflate_free(void *opaque, void *address)
+{
+    /* freed with the request pool */
+}
+
+/*
+** @description: This function is called to record an error of the
+** compressed body, the rest of the body is ignored.
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_http_yy_sec_waf_inflate_t *inf
+** @para: char *msg
+** @return: NGX_ERROR.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_inflate_error(ngx_http_request_ctx_t *ctx,
+    ngx_http_yy_sec_waf_inflate_t *inf, char *msg)
+{
+    inf->error = 1;
+
+    ctx->process_body_error = 1;
+    ctx->process_body_error_msg.data = (u_char *) msg;
+    ctx->process_body_error_msg.len = ngx_strlen(msg);
+
+    return NGX_ERROR;
+}
+
+#endif
+
+/*
+** @description: This function is called to set up inflating of a body
+** with a gzip or deflate Content-Encoding.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: NGX_OK or NGX_ERROR if the encoding is unknown or failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_inflate_init(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx)
+{
+    ngx_table_elt_t               *h;
+#if (NGX_ZLIB)
+    ngx_http_yy_sec_waf_inflate_t *inf;
+#endif
+
+    h = ngx_http_yy_sec_waf_content_encoding(r);
+
+    if (h == NULL || (h->value.len == ngx_strlen("identity")
+        && !ngx_strncasecmp(h->value.data, (u_char *) "identity", h->value.len)))
+    {
+        return NGX_OK;
+    }
+
+#if (NGX_ZLIB)
+    if ((h->value.len == ngx_strlen("gzip")
+         && !ngx_strncasecmp(h->value.data, (u_char *) "gzip", h->value.len))
+        || (h->value.len == ngx_strlen("x-gzip")
+            && !ngx_strncasecmp(h->value.data, (u_char *) "x-gzip", h->value.len))
+        || (h->value.len == ngx_strlen("deflate")
+            && !ngx_strncasecmp(h->value.data, (u_char *) "deflate", h->value.len)))
+    {
+        inf = ngx_pcalloc(r->pool, sizeof(ngx_http_yy_sec_waf_inflate_t));
+        if (inf == NULL)
+            return NGX_ERROR;
+
+        inf->zstream.zalloc = ngx_http_yy_sec_waf_inflate_alloc;
+        inf->zstream.zfree = ngx_http_yy_sec_waf_inflate_free;
+        inf->zstream.opaque = r->pool;
+
+        /* gzip or zlib header, detected by zlib */
+        if (inflateInit2(&inf->zstream, MAX_WBITS + 32) != Z_OK)
+            return NGX_ERROR;
+
+        ctx->body_inflate = inf;
+
+        return NGX_OK;
+    }
+#endif
+
+    ctx->process_body_error = 1;
+    ngx_str_set(&ctx->process_body_error_msg, "UNCOMMON_CONTENT_ENCODING");
+
+    return NGX_ERROR;
+}
+
+/*
+** @description: This function is called to find out the type of the body
+** and to set up its parser, before the body is fed to it.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: NGX_OK, NGX_DECLINED if the body isn't parsed or NGX_ERROR if failed.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_body_init(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx)
+{
+    ngx_uint_t type;
+
+    if (r->headers_in.content_type == NULL)
+        return NGX_DECLINED;
+
+    type = ngx_http_yy_sec_waf_body_type(r, ctx->cf->body_types);
+
+    switch (type) {
+        case BODY_TYPE_MULTIPART:
+            if (ngx_http_yy_sec_waf_multipart_init(r, ctx) != NGX_OK)
+                return NGX_ERROR;
+            break;
+        case BODY_TYPE_URLENCODED:
+            break;
+        case BODY_TYPE_JSON:
+            if (ngx_http_yy_sec_waf_json_init(r, ctx) != NGX_OK)
+                return NGX_ERROR;
+            break;
+        case BODY_TYPE_XML:
+            if (ngx_http_yy_sec_waf_xml_init(r, ctx) != NGX_OK)
+                return NGX_ERROR;
+            break;
+        default:
+            /* BODY_TYPE_NONE or not known */
+            return NGX_DECLINED;
+    }
+
+    ctx->body_type = type;
+
+    ctx->body_limit = ngx_http_yy_sec_waf_body_limit(r, ctx->cf);
+
+    return ngx_http_yy_sec_waf_inflate_init(r, ctx);
+}
+
+/*
+** @description: This function is called to feed a part of the body, as
+** it is after inflating, to the parser of the body.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: u_char *p
+** @para: u_char *last
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_body_parse(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, u_char *p, u_char *last)
+{
+    switch (ctx->body_type) {
+        case BODY_TYPE_MULTIPART:
+            return ngx_http_yy_sec_waf_multipart_feed(r, ctx, p, last);
+        case BODY_TYPE_URLENCODED:
+            return ngx_http_yy_sec_waf_urlencoded_feed(r, ctx, p, last);
+        case BODY_TYPE_JSON:
+            return ngx_http_yy_sec_waf_json_feed(r, ctx, p, last);
+        case BODY_TYPE_XML:
+            return ngx_http_yy_sec_waf_xml_feed(r, ctx, p, last);
+        default:
+            return NGX_OK;
+    }
+}
+
+/*
+** @description: This function is called to feed a part of the body to
+** the parser of the body. A compressed body is inflated a window at a
+** time, and each window is parsed before the next one is inflated.
+** The bytes past the inspection window of the body are not parsed.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: u_char *p
+** @para: u_char *last
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_body_feed_data(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, u_char *p, u_char *last)
+{
+#if (NGX_ZLIB)
+    int                             rc;
+    size_t                          n;
+    z_stream                       *zs;
+    ngx_http_yy_sec_waf_inflate_t  *inf;
+#endif
+
+    if (ctx->body_truncated)
+        return NGX_OK;
+
+    /* the inspection window is counted in bytes as they are read */
+    if (ctx->body_limit
+        && (size_t) (last - p) > ctx->body_limit - ctx->body_inspected)
+    {
+        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                      "[ysec_waf] post body inspected up to %uz bytes",
+                      ctx->body_limit);
+        last = p + (ctx->body_limit - ctx->body_inspected);
+        ctx->body_truncated = 1;
+    }
+
+    ctx->body_inspected += last - p;
+
+#if (NGX_ZLIB)
+    inf = ctx->body_inflate;
+
+    if (inf == NULL)
+        return ngx_http_yy_sec_waf_body_parse(r, ctx, p, last);
+
+    /* bytes after the end of the compressed stream are ignored */
+    if (inf->done || inf->error)
+        return inf->error? NGX_ERROR: NGX_OK;
+
+    zs = &inf->zstream;
+    zs->next_in = p;
+    zs->avail_in = last - p;
+
+    do {
+        zs->next_out = inf->out;
+        zs->avail_out = INFLATE_WINDOW_SIZE;
+
+        rc = inflate(zs, Z_NO_FLUSH);
+
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+            ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "[ysec_waf] inflate() failed: %d", rc);
+            return ngx_http_yy_sec_waf_inflate_error(ctx, inf, "UNCOMMON_CONTENT_ENCODING");
+        }
+
+        if (zs->total_out > ctx->cf->body_inflate_max_size)
+            return ngx_http_yy_sec_waf_inflate_error(ctx, inf, "UNCOMMON_INFLATE_SIZE");
+
+        if (ctx->cf->body_inflate_max_ratio
+            && zs->total_out > INFLATE_WINDOW_SIZE
+            && zs->total_out / ctx->cf->body_inflate_max_ratio > zs->total_in)
+        {
+            return ngx_http_yy_sec_waf_inflate_error(ctx, inf, "UNCOMMON_INFLATE_RATIO");
+        }
+
+        n = INFLATE_WINDOW_SIZE - zs->avail_out;
+
+        if (n && ngx_http_yy_sec_waf_body_parse(r, ctx, inf->out, inf->out + n) != NGX_OK)
+            return NGX_ERROR;
+
+        if (rc == Z_STREAM_END) {
+            inf->done = 1;
+            inflateEnd(zs);
+            break;
+        }
+
+    } while (zs->avail_out == 0);
+
+    return NGX_OK;
+#else
+    return ngx_http_yy_sec_waf_body_parse(r, ctx, p, last);
+#endif
+}
+
+/*
+** @description: This function is called to feed body buffers to the parser
+** of the body. Buffers which are not in memory are skipped.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_chain_t *in
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_body_feed(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_chain_t *in)
+{
+    ngx_chain_t *cl;
+
+    for (cl = in; cl; cl = cl->next) {
+        if (!ngx_buf_in_memory(cl->buf) || cl->buf->pos == cl->buf->last)
+            continue;
+
+        /* a streamed body is read into the same buffer again and again */
+        ctx->tfn_generation++;
+
+        if (ngx_http_yy_sec_waf_body_feed_data(r, ctx, cl->buf->pos,
+                                               cl->buf->last) != NGX_OK)
+            return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+typedef struct {
+    u_char *addr;
+    size_t  len;
+} ngx_http_yy_sec_waf_body_map_t;
+
+static void
+ngx_http_yy_sec_waf_body_unmap(void *data)
+{
+    ngx_http_yy_sec_waf_body_map_t *map = data;
+
+    munmap(map->addr, map->len);
+}
+
+/*
+** @description: This function is called to feed a body buffer in a temp
+** file. The file is mapped read-only until the request is finalized, since
+** the parsed arguments point into it.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_buf_t *b
+** @para: size_t size, the number of bytes to feed.
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_body_feed_file(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_buf_t *b, size_t size)
+{
+    off_t                           offset;
+    u_char                         *addr;
+    ngx_pool_cleanup_t             *cln;
+    ngx_http_yy_sec_waf_body_map_t *map;
+
+    /* mmap() wants an offset at a page boundary */
+    offset = b->file_pos & ~((off_t) ngx_pagesize - 1);
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_yy_sec_waf_body_map_t));
+    if (cln == NULL)
+        return NGX_ERROR;
+
+    map = cln->data;
+    map->len = (size_t) (b->file_pos - offset) + size;
+
+    addr = mmap(NULL, map->len, PROT_READ, MAP_SHARED, b->file->fd, offset);
+
+    if (addr == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno,
+                      "[ysec_waf] mmap(\"%V\") failed", &b->file->name);
+        return NGX_ERROR;
+    }
+
+    map->addr = addr;
+    cln->handler = ngx_http_yy_sec_waf_body_unmap;
+
+    addr += b->file_pos - offset;
+
+    return ngx_http_yy_sec_waf_body_feed_data(r, ctx, addr, addr + size);
+}
+
+/*
+** @description: This function is called at the end of the body, after
+** the last buffer is fed.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_body_finish(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx)
+{
+    /* the end of a truncated body is no end of its arguments or parts */
+    if (ctx->body_truncated)
+        return NGX_OK;
+
+#if (NGX_ZLIB)
+    if (ctx->body_inflate && !ctx->body_inflate->done) {
+        if (ctx->body_inflate->error)
+            return NGX_ERROR;
+
+        /* the compressed stream is cut short */
+        return ngx_http_yy_sec_waf_inflate_error(ctx, ctx->body_inflate,
+                                                 "UNCOMMON_CONTENT_ENCODING");
+    }
+#endif
+
+    switch (ctx->body_type) {
+        case BODY_TYPE_MULTIPART:
+            return ngx_http_yy_sec_waf_multipart_finish(r, ctx);
+        case BODY_TYPE_URLENCODED:
+            if (ctx->body_pending.len == 0)
+                return NGX_OK;
+
+            return ngx_http_yy_sec_waf_process_spliturl(r, &ctx->body_pending,
+                                                        ctx, PROCESS_ARGS_POST);
+        case BODY_TYPE_JSON:
+            return ngx_http_yy_sec_waf_json_finish(r, ctx);
+        case BODY_TYPE_XML:
+            return ngx_http_yy_sec_waf_xml_finish(r, ctx);
+        default:
+            return NGX_OK;
+    }
+}
+
+/*
+** @description: This function is called after the body rules have run, so
+** that their next run, on the next body buffer, sees the new elements only.
+** @para: ngx_http_request_ctx_t *ctx
+** @return: void
+*/
+
+void
+ngx_http_yy_sec_waf_body_checked(ngx_http_request_ctx_t *ctx)
+{
+    ctx->args.checked = ctx->args.elts.nelts;
+    ctx->args_get.checked = ctx->args_get.elts.nelts;
+    ctx->args_post.checked = ctx->args_post.elts.nelts;
+    ctx->multipart.checked = ctx->multipart.elts.nelts;
+    ctx->multipart_part_headers.checked = ctx->multipart_part_headers.elts.nelts;
+    ctx->multipart_part_body.checked = ctx->multipart_part_body.elts.nelts;
+    ctx->multipart_file_type.checked = ctx->multipart_file_type.elts.nelts;
+    ctx->cookies.checked = ctx->cookies.elts.nelts;
+    ctx->headers.checked = ctx->headers.elts.nelts;
+}
+
+/*
+** @description: This function is called to process the body of the request.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_loc_conf_t *cf
+** @para: ngx_http_request_ctx_t *ctx
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+ngx_int_t
 ngx_http_yy_sec_waf_process_body(ngx_http_request_t *r,
     ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx)
 {
-    u_char      *src;
-    ngx_chain_t *bb;
-    ngx_str_t   *full_body;
+    size_t       rest, size;
+    ngx_int_t    rc;
+    ngx_buf_t   *b;
+    ngx_chain_t *cl;
+    ngx_uint_t   truncated;
+
+    /* the buffers are parsed already, as they were read */
+    if (ctx->body_streaming) {
+        ngx_http_yy_sec_waf_body_finish(r, ctx);
+        return NGX_OK;
+    }
 
     if (!r->request_body->bufs || !r->headers_in.content_type) {
         ctx->process_body_error = 1;
@@ -461,56 +1929,66 @@ ngx_http_yy_sec_waf_process_body(ngx_http_request_t *r,
         return NGX_ERROR;
     }
 
-    if (r->request_body->temp_file) {
+    if (r->request_body->temp_file && cf->body_file_inspect_size == 0) {
         ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] post body is stored in temp_file.");
         return NGX_OK;
     }
 
-    full_body = ngx_palloc(r->pool, sizeof(ngx_str_t));
-    if (full_body == NULL) {
-        return NGX_ERROR;
-    }
+    /* the buffers are parsed where they are, the body is never joined */
+    if (ngx_http_yy_sec_waf_body_init(r, ctx) != NGX_OK)
+        return NGX_OK;
 
-    if (r->request_body->bufs->next == NULL) {
-        full_body->len = (ngx_uint_t) (r->request_body->bufs->buf->last
-            - r->request_body->bufs->buf->pos);
+    rest = cf->body_file_inspect_size;
 
-        full_body->data = ngx_pcalloc(r->pool, full_body->len+1);
+    for (cl = r->request_body->bufs; cl; cl = cl->next) {
+        b = cl->buf;
+        truncated = 0;
 
-        ngx_memcpy(full_body->data, r->request_body->bufs->buf->pos, full_body->len);
-    } else {
-        for (full_body->len = 0, bb = r->request_body->bufs; bb; bb = bb->next)
-            full_body->len += bb->buf->last - bb->buf->pos;
+        if (ngx_buf_in_memory(b)) {
+            if (b->pos == b->last)
+                continue;
 
-        full_body->data = ngx_pcalloc(r->pool, full_body->len+1);
+            rc = ngx_http_yy_sec_waf_body_feed_data(r, ctx, b->pos, b->last);
 
-        if (full_body->data == NULL)
-            return NGX_ERROR;
+        } else if (b->in_file) {
+            size = (size_t) (b->file_last - b->file_pos);
 
-        src = full_body->data;
+            if (size > rest) {
+                ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                              "[ysec_waf] post body in temp_file inspected up to %uz bytes",
+                              cf->body_file_inspect_size);
+                size = rest;
+                truncated = 1;
+            }
 
-        for (bb = r->request_body->bufs; bb; bb = bb->next)
-            full_body->data = ngx_cpymem(full_body->data, bb->buf->pos,
-                bb->buf->last - bb->buf->pos);
+            if (size == 0) {
+                if (!truncated)
+                    continue;
 
-        full_body->data = src;
-    }
+                /* the window was used up right at the end of a buffer */
+                ctx->body_truncated = 1;
+                break;
+            }
+
+            rest -= size;
+
+            rc = ngx_http_yy_sec_waf_body_feed_file(r, ctx, b, size);
 
-    //ngx_yy_sec_waf_unescape(full_body);
+        } else {
+            continue;
+        }
+
+        if (rc != NGX_OK)
+            return NGX_OK;
 
-    if (!ngx_strncasecmp(r->headers_in.content_type->value.data,
-        (u_char*)"multipart/form-data", ngx_strlen("multipart/form-data"))) {
-        /* MULTIPART */
-        ngx_http_yy_sec_waf_process_multipart(r, full_body, ctx);
-    } else if (!ngx_strncasecmp(r->headers_in.content_type->value.data,
-        (u_char*)"application/x-www-form-urlencoded", ngx_strlen("application/x-www-form-urlencoded"))) {
-        /* X-WWW-FORM-URLENCODED */
-        ctx->post_args_len = full_body->len;
+        if (truncated)
+            ctx->body_truncated = 1;
 
-        ngx_http_yy_sec_waf_process_spliturl(r, full_body, ctx, PROCESS_ARGS_POST);
+        if (ctx->body_truncated)
+            break;
     }
 
+    ngx_http_yy_sec_waf_body_finish(r, ctx);
+
     return NGX_OK;
 }
-
-
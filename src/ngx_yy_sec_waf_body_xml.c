@@ -0,0 +1,816 @@
+/*
+** @file: ngx_yy_sec_waf_body_xml.c
+** @description: This is the xml body parser for yy sec waf.
+** @author: dw_liqi1<liqi1@yy.com>
+** @date: 2026.10.18
+** Copyright (C) YY, Inc.
+*/
+
+#include "ngx_yy_sec_waf.h"
+
+#define XML_DEPTH_MAX     64
+#define XML_NODES_MAX     10000
+#define XML_PATH_MAX      1024
+#define XML_NAME_MAX      256
+#define XML_ENTITY_MAX    10
+
+struct ngx_http_yy_sec_waf_xml_s {
+    ngx_uint_t  state;
+
+    /* the path length outside of each open element */
+    ngx_uint_t  depth;
+    size_t      base[XML_DEPTH_MAX];
+
+    /* the names of the open elements, joined with '.' */
+    u_char      path[XML_PATH_MAX];
+    size_t      path_len;
+    /* copy of the path, shared by the text nodes of an element */
+    ngx_str_t   name;
+
+    /* the attribute name or the end tag being read */
+    u_char      attr[XML_NAME_MAX];
+    size_t      attr_len;
+
+    /* the text or the attribute value being read, it may span buffers */
+    u_char     *buf;
+    size_t      len;
+    size_t      size;
+
+    /* a reference being read, and the state to go back to after it */
+    u_char      entity[XML_ENTITY_MAX];
+    size_t      entity_len;
+    ngx_uint_t  entity_state;
+
+    u_char      quote;
+    /* bytes of "-->", "]]>", "?>" or "[CDATA[" matched */
+    size_t      matched;
+
+    ngx_uint_t  nodes;
+    /* bytes of a leading UTF-8 byte order mark matched */
+    size_t      bom_len;
+    unsigned    bom_done:1;
+    unsigned    root:1;
+};
+
+enum {
+    xml_sw_text = 0,
+    xml_sw_lt,
+    xml_sw_bang,
+    xml_sw_comment_open,
+    xml_sw_comment,
+    xml_sw_cdata_open,
+    xml_sw_cdata,
+    xml_sw_pi,
+    xml_sw_start_name,
+    xml_sw_tag,
+    xml_sw_empty,
+    xml_sw_attr_name,
+    xml_sw_attr_eq,
+    xml_sw_attr_quote,
+    xml_sw_attr_value,
+    xml_sw_end_name,
+    xml_sw_end,
+    xml_sw_entity,
+    xml_sw_error
+};
+
+#define xml_space(ch)  ((ch) == ' ' || (ch) == '\t' || (ch) == '\r' || (ch) == '\n')
+
+/*
+** @description: This function is called to record an error of the xml
+** body, the parser ignores the rest of the body.
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_http_yy_sec_waf_xml_t *xs
+** @para: char *msg
+** @return: NGX_ERROR.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_xml_error(ngx_http_request_ctx_t *ctx,
+    ngx_http_yy_sec_waf_xml_t *xs, char *msg)
+{
+    xs->state = xml_sw_error;
+
+    ctx->process_body_error = 1;
+    ctx->process_body_error_msg.data = (u_char *) msg;
+    ctx->process_body_error_msg.len = ngx_strlen(msg);
+
+    return NGX_ERROR;
+}
+
+/*
+** @description: This function is called to append to the text or the
+** attribute value being read. The buffer is reused by the next one.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_xml_t *xs
+** @para: u_char *p
+** @para: size_t n
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_xml_append(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_xml_t *xs, u_char *p, size_t n)
+{
+    u_char *buf;
+    size_t  size;
+
+    if (xs->len + n > xs->size) {
+        size = ngx_max(2 * xs->size, xs->len + n);
+        size = ngx_max(size, 64);
+
+        buf = ngx_pnalloc(r->pool, size);
+        if (buf == NULL)
+            return NGX_ERROR;
+
+        ngx_memcpy(buf, xs->buf, xs->len);
+
+        xs->buf = buf;
+        xs->size = size;
+    }
+
+    ngx_memcpy(xs->buf + xs->len, p, n);
+    xs->len += n;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to add the text of an element, or
+** a value of an attribute named path@attribute, to ARGS and ARGS_POST.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_http_yy_sec_waf_xml_t *xs
+** @para: ngx_uint_t attr, 1 for an attribute.
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_xml_value(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_http_yy_sec_waf_xml_t *xs, ngx_uint_t attr)
+{
+    u_char    *p;
+    char      *msg;
+    ngx_str_t  name, value;
+
+    if (++xs->nodes > XML_NODES_MAX)
+        return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_NODES");
+
+    if (attr) {
+        name.len = xs->path_len + 1 + xs->attr_len;
+        name.data = ngx_pnalloc(r->pool, name.len + 1);
+        if (name.data == NULL)
+            return NGX_ERROR;
+
+        p = ngx_cpymem(name.data, xs->path, xs->path_len);
+        *p++ = '@';
+        p = ngx_cpymem(p, xs->attr, xs->attr_len);
+        *p = '\0';
+
+    } else {
+        if (xs->name.data == NULL) {
+            xs->name.len = xs->path_len;
+            xs->name.data = ngx_pnalloc(r->pool, xs->path_len + 1);
+            if (xs->name.data == NULL)
+                return NGX_ERROR;
+
+            ngx_memcpy(xs->name.data, xs->path, xs->path_len);
+            xs->name.data[xs->path_len] = '\0';
+        }
+
+        name = xs->name;
+    }
+
+    value.len = xs->len;
+
+    msg = ngx_http_yy_sec_waf_args_limit(ctx, &name, &value);
+    if (msg != NULL)
+        return ngx_http_yy_sec_waf_xml_error(ctx, xs, msg);
+
+    value.data = ngx_pnalloc(r->pool, xs->len + 1);
+    if (value.data == NULL)
+        return NGX_ERROR;
+
+    ngx_memcpy(value.data, xs->buf, xs->len);
+    value.data[xs->len] = '\0';
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] name=%V, value=%V", &name, &value);
+
+    if (ngx_yy_sec_waf_collection_push(r->pool, &ctx->args_post, &name, &value) == NULL
+        || ngx_yy_sec_waf_collection_push(r->pool, &ctx->args, &name, &value) == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    ctx->post_args_count = ctx->args_post.elts.nelts;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called when the text before a tag is
+** read. Text of whitespace only is dropped.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_http_yy_sec_waf_xml_t *xs
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_xml_text(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_http_yy_sec_waf_xml_t *xs)
+{
+    size_t i;
+
+    for (i = 0; i < xs->len; i++) {
+        if (!xml_space(xs->buf[i]))
+            break;
+    }
+
+    if (i == xs->len) {
+        xs->len = 0;
+        return NGX_OK;
+    }
+
+    if (xs->depth == 0)
+        return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+
+    if (ngx_http_yy_sec_waf_xml_value(r, ctx, xs, 0) != NGX_OK)
+        return NGX_ERROR;
+
+    xs->len = 0;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to decode a reference. Only the
+** predefined entities and character references are known, as there is
+** no DTD to declare others.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_http_yy_sec_waf_xml_t *xs
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_xml_entity(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, ngx_http_yy_sec_waf_xml_t *xs)
+{
+    u_char     *e, utf8[4];
+    size_t      i, n;
+    ngx_uint_t  c, d;
+
+    e = xs->entity;
+    n = xs->entity_len;
+
+    if (n == 2 && !ngx_strncmp(e, "lt", 2)) {
+        c = '<';
+    } else if (n == 2 && !ngx_strncmp(e, "gt", 2)) {
+        c = '>';
+    } else if (n == 3 && !ngx_strncmp(e, "amp", 3)) {
+        c = '&';
+    } else if (n == 4 && !ngx_strncmp(e, "quot", 4)) {
+        c = '"';
+    } else if (n == 4 && !ngx_strncmp(e, "apos", 4)) {
+        c = '\'';
+
+    } else if (n > 1 && e[0] == '#') {
+        c = 0;
+
+        if (e[1] == 'x') {
+            for (i = 2; i < n; i++) {
+                if (e[i] >= '0' && e[i] <= '9') {
+                    d = e[i] - '0';
+                } else if ((e[i] | 0x20) >= 'a' && (e[i] | 0x20) <= 'f') {
+                    d = (e[i] | 0x20) - 'a' + 10;
+                } else {
+                    return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+                }
+
+                c = c * 16 + d;
+            }
+
+            if (n == 2)
+                return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+
+        } else {
+            for (i = 1; i < n; i++) {
+                if (e[i] < '0' || e[i] > '9')
+                    return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+
+                c = c * 10 + (e[i] - '0');
+            }
+        }
+
+        if (c == 0)
+            return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_HEX_ENCODING");
+
+        if (c > 0x10ffff)
+            return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+
+    } else {
+        return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_ENTITY");
+    }
+
+    if (c < 0x80) {
+        utf8[0] = (u_char) c;
+        n = 1;
+    } else if (c < 0x800) {
+        utf8[0] = (u_char) (0xc0 | (c >> 6));
+        utf8[1] = (u_char) (0x80 | (c & 0x3f));
+        n = 2;
+    } else if (c < 0x10000) {
+        utf8[0] = (u_char) (0xe0 | (c >> 12));
+        utf8[1] = (u_char) (0x80 | ((c >> 6) & 0x3f));
+        utf8[2] = (u_char) (0x80 | (c & 0x3f));
+        n = 3;
+    } else {
+        utf8[0] = (u_char) (0xf0 | (c >> 18));
+        utf8[1] = (u_char) (0x80 | ((c >> 12) & 0x3f));
+        utf8[2] = (u_char) (0x80 | ((c >> 6) & 0x3f));
+        utf8[3] = (u_char) (0x80 | (c & 0x3f));
+        n = 4;
+    }
+
+    return ngx_http_yy_sec_waf_xml_append(r, xs, utf8, n);
+}
+
+/*
+** @description: This function is called to start parsing an xml body.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_xml_init(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx)
+{
+    ngx_http_yy_sec_waf_xml_t *xs;
+
+    xs = ngx_pcalloc(r->pool, sizeof(ngx_http_yy_sec_waf_xml_t));
+    if (xs == NULL)
+        return NGX_ERROR;
+
+    xs->state = xml_sw_text;
+
+    ctx->xml_parser = xs;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to feed a buffer of the body to the
+** xml parser. The body is read in one pass, the parser keeps its state
+** between the buffers. Element text and attribute values are added to ARGS
+** and ARGS_POST, a DTD or an unknown entity stops the parser.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: u_char *p
+** @para: u_char *last
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_xml_feed(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx, u_char *p, u_char *last)
+{
+    u_char                     *q, ch;
+    size_t                      len;
+    ngx_http_yy_sec_waf_xml_t  *xs;
+
+    static u_char               cdata[] = "[CDATA[";
+    static u_char               bom[] = "\xef\xbb\xbf";
+
+    xs = ctx->xml_parser;
+
+    /* a UTF-8 byte order mark may come before anything else */
+    if (!xs->bom_done) {
+        while (p < last && xs->bom_len < 3 && *p == bom[xs->bom_len]) {
+            p++;
+            xs->bom_len++;
+        }
+
+        if (xs->bom_len < 3 && p == last)
+            return NGX_OK;
+
+        xs->bom_done = 1;
+
+        /* the start of a mark only, it is text */
+        if (xs->bom_len < 3 && xs->bom_len
+            && ngx_http_yy_sec_waf_xml_feed(r, ctx, bom, bom + xs->bom_len) != NGX_OK)
+            return NGX_ERROR;
+    }
+
+    while (p < last) {
+
+        ch = *p;
+
+        switch (xs->state) {
+
+        case xml_sw_text:
+
+            /* the bytes up to markup or a reference are copied at once */
+            for (q = p; q < last && *q != '<' && *q != '&'; q++) {
+                /* void */
+            }
+
+            if (q > p && ngx_http_yy_sec_waf_xml_append(r, xs, p, q - p) != NGX_OK)
+                return NGX_ERROR;
+
+            p = q;
+
+            if (p == last)
+                break;
+
+            p++;
+
+            if (*q == '&') {
+                xs->entity_len = 0;
+                xs->entity_state = xml_sw_text;
+                xs->state = xml_sw_entity;
+                break;
+            }
+
+            if (ngx_http_yy_sec_waf_xml_text(r, ctx, xs) != NGX_OK)
+                return NGX_ERROR;
+
+            xs->state = xml_sw_lt;
+            break;
+
+        case xml_sw_lt:
+
+            p++;
+
+            if (ch == '/') {
+                xs->attr_len = 0;
+                xs->state = xml_sw_end_name;
+                break;
+            }
+
+            if (ch == '?') {
+                xs->matched = 0;
+                xs->state = xml_sw_pi;
+                break;
+            }
+
+            if (ch == '!') {
+                xs->state = xml_sw_bang;
+                break;
+            }
+
+            if (xml_space(ch) || ch == '>' || ch == '=' || ch == '<')
+                return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+
+            /* a start tag, there is one root element only */
+            if (xs->depth == 0 && xs->root)
+                return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+
+            if (xs->depth == XML_DEPTH_MAX)
+                return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_DEPTH");
+
+            if (++xs->nodes > XML_NODES_MAX)
+                return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_NODES");
+
+            xs->root = 1;
+            xs->base[xs->depth++] = xs->path_len;
+
+            if (xs->path_len + 2 > XML_PATH_MAX)
+                return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+
+            if (xs->path_len)
+                xs->path[xs->path_len++] = '.';
+
+            xs->path[xs->path_len++] = ch;
+            ngx_str_null(&xs->name);
+
+            xs->state = xml_sw_start_name;
+            break;
+
+        case xml_sw_bang:
+
+            p++;
+
+            if (ch == '-') {
+                xs->state = xml_sw_comment_open;
+                break;
+            }
+
+            if (ch == '[' && xs->depth) {
+                xs->matched = 1;
+                xs->state = xml_sw_cdata_open;
+                break;
+            }
+
+            /* <!DOCTYPE, or declarations which belong in a DTD */
+            return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_DTD");
+
+        case xml_sw_comment_open:
+
+            if (ch != '-')
+                return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+
+            p++;
+            xs->matched = 0;
+            xs->state = xml_sw_comment;
+            break;
+
+        case xml_sw_comment:
+
+            p++;
+
+            if (ch == '-') {
+                if (xs->matched < 2)
+                    xs->matched++;
+                break;
+            }
+
+            if (ch == '>' && xs->matched == 2) {
+                xs->state = xml_sw_text;
+                break;
+            }
+
+            xs->matched = 0;
+            break;
+
+        case xml_sw_cdata_open:
+
+            if (ch != cdata[xs->matched])
+                return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+
+            p++;
+
+            if (++xs->matched == sizeof(cdata) - 1) {
+                xs->matched = 0;
+                xs->state = xml_sw_cdata;
+            }
+
+            break;
+
+        case xml_sw_cdata:
+
+            /* the section is text, up to "]]>" */
+            p++;
+
+            if (ch == ']') {
+                if (xs->matched == 2) {
+                    if (ngx_http_yy_sec_waf_xml_append(r, xs, &ch, 1) != NGX_OK)
+                        return NGX_ERROR;
+                } else {
+                    xs->matched++;
+                }
+
+                break;
+            }
+
+            if (ch == '>' && xs->matched == 2) {
+                xs->state = xml_sw_text;
+                break;
+            }
+
+            if (xs->matched
+                && ngx_http_yy_sec_waf_xml_append(r, xs, (u_char *) "]]", xs->matched) != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            xs->matched = 0;
+
+            if (ngx_http_yy_sec_waf_xml_append(r, xs, &ch, 1) != NGX_OK)
+                return NGX_ERROR;
+
+            break;
+
+        case xml_sw_pi:
+
+            p++;
+
+            if (ch == '>' && xs->matched) {
+                xs->state = xml_sw_text;
+                break;
+            }
+
+            xs->matched = (ch == '?');
+            break;
+
+        case xml_sw_start_name:
+
+            if (xml_space(ch) || ch == '/' || ch == '>') {
+                xs->state = xml_sw_tag;
+                break;
+            }
+
+            if (xs->path_len == XML_PATH_MAX || ch == '<' || ch == '=')
+                return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+
+            xs->path[xs->path_len++] = ch;
+            p++;
+            break;
+
+        case xml_sw_tag:
+
+            p++;
+
+            if (xml_space(ch))
+                break;
+
+            if (ch == '/') {
+                xs->state = xml_sw_empty;
+                break;
+            }
+
+            if (ch == '>') {
+                xs->len = 0;
+                xs->state = xml_sw_text;
+                break;
+            }
+
+            if (ch == '<' || ch == '=' || ch == '"' || ch == '\'')
+                return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+
+            xs->attr[0] = ch;
+            xs->attr_len = 1;
+            xs->state = xml_sw_attr_name;
+            break;
+
+        case xml_sw_empty:
+
+            if (ch != '>')
+                return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+
+            p++;
+            goto close;
+
+        case xml_sw_attr_name:
+
+            if (xml_space(ch) || ch == '=') {
+                xs->state = xml_sw_attr_eq;
+                break;
+            }
+
+            if (xs->attr_len == XML_NAME_MAX || ch == '<' || ch == '>' || ch == '/')
+                return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+
+            xs->attr[xs->attr_len++] = ch;
+            p++;
+            break;
+
+        case xml_sw_attr_eq:
+
+            p++;
+
+            if (xml_space(ch))
+                break;
+
+            if (ch != '=')
+                return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+
+            xs->state = xml_sw_attr_quote;
+            break;
+
+        case xml_sw_attr_quote:
+
+            p++;
+
+            if (xml_space(ch))
+                break;
+
+            if (ch != '"' && ch != '\'')
+                return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+
+            xs->quote = ch;
+            xs->len = 0;
+            xs->state = xml_sw_attr_value;
+            break;
+
+        case xml_sw_attr_value:
+
+            for (q = p; q < last && *q != xs->quote && *q != '&' && *q != '<'; q++) {
+                /* void */
+            }
+
+            if (q > p && ngx_http_yy_sec_waf_xml_append(r, xs, p, q - p) != NGX_OK)
+                return NGX_ERROR;
+
+            p = q;
+
+            if (p == last)
+                break;
+
+            p++;
+
+            if (*q == '<')
+                return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+
+            if (*q == '&') {
+                xs->entity_len = 0;
+                xs->entity_state = xml_sw_attr_value;
+                xs->state = xml_sw_entity;
+                break;
+            }
+
+            if (ngx_http_yy_sec_waf_xml_value(r, ctx, xs, 1) != NGX_OK)
+                return NGX_ERROR;
+
+            xs->len = 0;
+            xs->state = xml_sw_tag;
+            break;
+
+        case xml_sw_end_name:
+
+            if (xml_space(ch) || ch == '>') {
+                xs->state = xml_sw_end;
+                break;
+            }
+
+            if (xs->attr_len == XML_NAME_MAX)
+                return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+
+            xs->attr[xs->attr_len++] = ch;
+            p++;
+            break;
+
+        case xml_sw_end:
+
+            p++;
+
+            if (xml_space(ch))
+                break;
+
+            if (ch != '>' || xs->depth == 0)
+                return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+
+            /* the end tag has to match the name of the open element */
+            len = xs->base[xs->depth - 1];
+            if (len)
+                len++;
+
+            if (xs->path_len - len != xs->attr_len
+                || ngx_memcmp(xs->path + len, xs->attr, xs->attr_len) != 0)
+            {
+                return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+            }
+
+            goto close;
+
+        case xml_sw_entity:
+
+            p++;
+
+            if (ch == ';') {
+                if (ngx_http_yy_sec_waf_xml_entity(r, ctx, xs) != NGX_OK)
+                    return NGX_ERROR;
+
+                xs->state = xs->entity_state;
+                break;
+            }
+
+            if (xs->entity_len == XML_ENTITY_MAX)
+                return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+
+            xs->entity[xs->entity_len++] = ch;
+            break;
+
+        default:
+            return NGX_ERROR;
+        }
+
+        continue;
+
+    close:
+
+        xs->depth--;
+        xs->path_len = xs->base[xs->depth];
+        ngx_str_null(&xs->name);
+
+        xs->len = 0;
+        xs->state = xml_sw_text;
+    }
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called at the end of an xml body.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: NGX_OK or NGX_ERROR if the body is incomplete.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_xml_finish(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx)
+{
+    ngx_http_yy_sec_waf_xml_t *xs;
+
+    xs = ctx->xml_parser;
+
+    if (xs->state == xml_sw_error)
+        return NGX_ERROR;
+
+    if (xs->state != xml_sw_text || xs->depth || !xs->root)
+        return ngx_http_yy_sec_waf_xml_error(ctx, xs, "UNCOMMON_XML_FORMAT");
+
+    return ngx_http_yy_sec_waf_xml_text(r, ctx, xs);
+}
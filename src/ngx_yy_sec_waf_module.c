@@ -16,6 +16,24 @@ static void * ngx_http_yy_sec_waf_create_loc_conf(ngx_conf_t *cf);
 static char * ngx_http_yy_sec_waf_merge_loc_conf(ngx_conf_t *cf,
     void *parent, void *child);
 
+static char * ngx_http_yy_sec_waf_body_streaming(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char * ngx_http_yy_sec_waf_inspect_limit_type(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char * ngx_http_yy_sec_waf_body_type(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_yy_sec_waf_body_types_init(ngx_conf_t *cf,
+    ngx_http_yy_sec_waf_body_types_t *bt);
+static ngx_http_yy_sec_waf_body_types_t *
+    ngx_http_yy_sec_waf_body_types_merge(ngx_conf_t *cf,
+    ngx_http_yy_sec_waf_body_types_t *bt, ngx_http_yy_sec_waf_body_types_t *prev);
+static char * ngx_http_yy_sec_waf_upload_filter(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_yy_sec_waf_upload_filter_init(ngx_conf_t *cf,
+    ngx_http_yy_sec_waf_upload_filter_t *uf);
+static ngx_http_yy_sec_waf_upload_filter_t *
+    ngx_http_yy_sec_waf_upload_filter_default(ngx_conf_t *cf);
+
 static ngx_http_request_ctx_t* ngx_http_yy_sec_waf_create_ctx(ngx_http_request_t *r,
     ngx_http_yy_sec_waf_loc_conf_t *cf);
 
@@ -27,6 +45,10 @@ extern ngx_int_t ngx_http_yy_sec_waf_process_request(ngx_http_request_t *r,
     ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx);
 
 extern ngx_int_t ngx_http_yy_sec_waf_re_create(ngx_conf_t *cf);
+extern ngx_uint_t ngx_http_yy_sec_waf_rules_var_flags(ngx_conf_t *cf,
+    ngx_array_t *rules);
+extern void yy_sec_waf_re_cache_init_rbtree(ngx_rbtree_t *rbtree,
+    ngx_rbtree_node_t *sentinel);
 extern ngx_int_t yy_sec_waf_re_process_normal_rules(ngx_http_request_t *r,
     ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx, ngx_uint_t phase);
 static ngx_int_t ngx_http_yy_sec_waf_module_init(ngx_cycle_t *cycle);
@@ -43,6 +65,9 @@ ngx_atomic_t   *request_logged  = &request_logged0;
 
 static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
 static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
+#if (YY_SEC_WAF_REQUEST_BODY_FILTER)
+static ngx_http_request_body_filter_pt   ngx_http_next_request_body_filter;
+#endif
 
 static ngx_command_t  ngx_http_yy_sec_waf_commands[] = {
     { ngx_string("yy_sec_waf"),
@@ -66,6 +91,97 @@ static ngx_command_t  ngx_http_yy_sec_waf_commands[] = {
       offsetof(ngx_http_yy_sec_waf_loc_conf_t, body_processor),
       NULL },
 
+    { ngx_string("body_streaming"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_http_yy_sec_waf_body_streaming,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, body_streaming),
+      NULL },
+
+    { ngx_string("body_type"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      ngx_http_yy_sec_waf_body_type,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("body_file_inspect_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, body_file_inspect_size),
+      NULL },
+
+    { ngx_string("body_inflate_max_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, body_inflate_max_size),
+      NULL },
+
+    { ngx_string("body_inflate_max_ratio"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, body_inflate_max_ratio),
+      NULL },
+
+    { ngx_string("body_inspect_limit"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, body_inspect_limit),
+      NULL },
+
+    { ngx_string("body_inspect_limit_type"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      ngx_http_yy_sec_waf_inspect_limit_type,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("multipart_part_inspect_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, multipart_part_inspect_size),
+      NULL },
+
+    { ngx_string("args_max_count"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, args_max_count),
+      NULL },
+
+    { ngx_string("args_max_name_length"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, args_max_name_length),
+      NULL },
+
+    { ngx_string("args_max_value_length"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, args_max_value_length),
+      NULL },
+
+    { ngx_string("args_max_total_length"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_yy_sec_waf_loc_conf_t, args_max_total_length),
+      NULL },
+
+    { ngx_string("upload_filter"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_2MORE,
+      ngx_http_yy_sec_waf_upload_filter,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("basic_rule"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_2MORE,
       ngx_http_yy_sec_waf_re_read_conf,
@@ -134,6 +250,16 @@ ngx_http_yy_sec_waf_create_loc_conf(ngx_conf_t *cf)
     conf->enabled = NGX_CONF_UNSET;
     conf->conn_processor = NGX_CONF_UNSET;
     conf->body_processor = NGX_CONF_UNSET;
+    conf->body_streaming = NGX_CONF_UNSET;
+    conf->body_file_inspect_size = NGX_CONF_UNSET_SIZE;
+    conf->body_inflate_max_size = NGX_CONF_UNSET_SIZE;
+    conf->body_inflate_max_ratio = NGX_CONF_UNSET_UINT;
+    conf->body_inspect_limit = NGX_CONF_UNSET_SIZE;
+    conf->multipart_part_inspect_size = NGX_CONF_UNSET_SIZE;
+    conf->args_max_count = NGX_CONF_UNSET_UINT;
+    conf->args_max_name_length = NGX_CONF_UNSET_SIZE;
+    conf->args_max_value_length = NGX_CONF_UNSET_SIZE;
+    conf->args_max_total_length = NGX_CONF_UNSET_SIZE;
 
     return conf;
 }
@@ -149,9 +275,10 @@ ngx_http_yy_sec_waf_create_loc_conf(ngx_conf_t *cf)
 static char *
 ngx_http_yy_sec_waf_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 {
-    (void) cf;
-    ngx_http_yy_sec_waf_loc_conf_t *prev = parent;
-    ngx_http_yy_sec_waf_loc_conf_t *conf = child;
+    ngx_http_yy_sec_waf_loc_conf_t      *prev = parent;
+    ngx_http_yy_sec_waf_loc_conf_t      *conf = child;
+    ngx_uint_t                           response_flags;
+    ngx_http_yy_sec_waf_inspect_limit_t *limit;
 
     if (conf->request_header_rules == NULL)
         conf->request_header_rules = prev->request_header_rules;
@@ -167,6 +294,39 @@ ngx_http_yy_sec_waf_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
         conf->shm_zone = prev->shm_zone;
     if (conf->server_ip.len == 0)
         conf->server_ip = prev->server_ip;
+    if (conf->body_inspect_limit_types == NULL) {
+        conf->body_inspect_limit_types = prev->body_inspect_limit_types;
+    } else if (prev->body_inspect_limit_types) {
+        /* the types of the levels above are looked up after our own */
+        limit = ngx_array_push_n(conf->body_inspect_limit_types,
+                                 prev->body_inspect_limit_types->nelts);
+        if (limit == NULL)
+            return NGX_CONF_ERROR;
+
+        ngx_memcpy(limit, prev->body_inspect_limit_types->elts,
+                   prev->body_inspect_limit_types->nelts
+                   * sizeof(ngx_http_yy_sec_waf_inspect_limit_t));
+    }
+    /* a registry is ready once merged, the one of http{} never is */
+    if (conf->body_types == NULL && prev->body_types && prev->body_types->ready) {
+        conf->body_types = prev->body_types;
+    } else {
+        conf->body_types = ngx_http_yy_sec_waf_body_types_merge(cf,
+                               conf->body_types, prev->body_types);
+        if (conf->body_types == NULL)
+            return NGX_CONF_ERROR;
+    }
+    if (ngx_http_yy_sec_waf_body_types_init(cf, conf->body_types) != NGX_OK)
+        return NGX_CONF_ERROR;
+    if (conf->upload_filter == NULL)
+        conf->upload_filter = prev->upload_filter;
+    if (conf->upload_filter == NULL) {
+        conf->upload_filter = ngx_http_yy_sec_waf_upload_filter_default(cf);
+        if (conf->upload_filter == NULL)
+            return NGX_CONF_ERROR;
+    }
+    if (ngx_http_yy_sec_waf_upload_filter_init(cf, conf->upload_filter) != NGX_OK)
+        return NGX_CONF_ERROR;
 
     ngx_conf_merge_value(conf->enabled, prev->enabled, 1);
 
@@ -174,9 +334,517 @@ ngx_http_yy_sec_waf_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_value(conf->body_processor, prev->body_processor, 1);
 
+    ngx_conf_merge_value(conf->body_streaming, prev->body_streaming, 0);
+
+    ngx_conf_merge_size_value(conf->body_file_inspect_size,
+                              prev->body_file_inspect_size, 1024 * 1024);
+
+    ngx_conf_merge_size_value(conf->body_inflate_max_size,
+                              prev->body_inflate_max_size, 10 * 1024 * 1024);
+
+    ngx_conf_merge_uint_value(conf->body_inflate_max_ratio,
+                              prev->body_inflate_max_ratio, 100);
+
+    ngx_conf_merge_size_value(conf->body_inspect_limit,
+                              prev->body_inspect_limit, 0);
+
+    ngx_conf_merge_size_value(conf->multipart_part_inspect_size,
+                              prev->multipart_part_inspect_size, 64 * 1024);
+
+    ngx_conf_merge_uint_value(conf->args_max_count, prev->args_max_count, 0);
+
+    ngx_conf_merge_size_value(conf->args_max_name_length,
+                              prev->args_max_name_length, 0);
+
+    ngx_conf_merge_size_value(conf->args_max_value_length,
+                              prev->args_max_value_length, 0);
+
+    ngx_conf_merge_size_value(conf->args_max_total_length,
+                              prev->args_max_total_length, 0);
+
+    response_flags = ngx_http_yy_sec_waf_rules_var_flags(cf, conf->response_header_rules)
+                     | ngx_http_yy_sec_waf_rules_var_flags(cf, conf->response_body_rules);
+
+    conf->var_flags = ngx_http_yy_sec_waf_rules_var_flags(cf, conf->request_header_rules)
+                      | ngx_http_yy_sec_waf_rules_var_flags(cf, conf->request_body_rules)
+                      | response_flags;
+
+    /* the body is read for the body rules, or response rules looking at it */
+    conf->body_needed = conf->request_body_rules != NULL
+                        || (response_flags & VAR_NEED_BODY);
+
+    return NGX_CONF_OK;
+}
+
+/*
+** @description: This function is called to read body_streaming, which needs
+** the request body filters of nginx 1.8.0.
+** @para: ngx_conf_t *cf
+** @para: ngx_command_t *cmd
+** @para: void *conf
+** @return: NGX_CONF_OK or NGX_CONF_ERROR if failed.
+*/
+
+static char *
+ngx_http_yy_sec_waf_body_streaming(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf)
+{
+    char  *rv;
+
+    rv = ngx_conf_set_flag_slot(cf, cmd, conf);
+
+#if !(YY_SEC_WAF_REQUEST_BODY_FILTER)
+    if (rv == NGX_CONF_OK
+        && ((ngx_http_yy_sec_waf_loc_conf_t *) conf)->body_streaming)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"body_streaming\" requires nginx 1.8.0 or later");
+        return NGX_CONF_ERROR;
+    }
+#endif
+
+    return rv;
+}
+
+/*
+** @description: This function is called to read the inspection window of
+** the bodies of a content type, e.g. body_inspect_limit_type image/png 64k.
+** @para: ngx_conf_t *cf
+** @para: ngx_command_t *cmd
+** @para: void *conf
+** @return: NGX_CONF_OK or NGX_CONF_ERROR if failed.
+*/
+
+static char *
+ngx_http_yy_sec_waf_inspect_limit_type(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf)
+{
+    ngx_http_yy_sec_waf_loc_conf_t      *lcf = conf;
+    ngx_str_t                           *value;
+    ssize_t                              size;
+    ngx_http_yy_sec_waf_inspect_limit_t *limit;
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[2]);
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid body inspect limit \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lcf->body_inspect_limit_types == NULL) {
+        lcf->body_inspect_limit_types = ngx_array_create(cf->pool, 4,
+            sizeof(ngx_http_yy_sec_waf_inspect_limit_t));
+        if (lcf->body_inspect_limit_types == NULL)
+            return NGX_CONF_ERROR;
+    }
+
+    limit = ngx_array_push(lcf->body_inspect_limit_types);
+    if (limit == NULL)
+        return NGX_CONF_ERROR;
+
+    /* the words of the configuration are null-terminated */
+    limit->type = value[1];
+    limit->limit = (size_t) size;
+
+    return NGX_CONF_OK;
+}
+
+/* the parsers a media type is mapped to by body_type */
+static ngx_conf_enum_t  body_processors[] = {
+    { ngx_string("urlencoded"), BODY_TYPE_URLENCODED },
+    { ngx_string("multipart"), BODY_TYPE_MULTIPART },
+    { ngx_string("json"), BODY_TYPE_JSON },
+    { ngx_string("xml"), BODY_TYPE_XML },
+    { ngx_string("none"), BODY_TYPE_NONE },
+    { ngx_null_string, 0 }
+};
+
+/* the media types every location parses, a "+" key is a suffix */
+static ngx_conf_enum_t  body_default_types[] = {
+    { ngx_string("application/x-www-form-urlencoded"), BODY_TYPE_URLENCODED },
+    { ngx_string("multipart/form-data"), BODY_TYPE_MULTIPART },
+    { ngx_string("application/json"), BODY_TYPE_JSON },
+    { ngx_string("+json"), BODY_TYPE_JSON },
+    { ngx_string("application/xml"), BODY_TYPE_XML },
+    { ngx_string("text/xml"), BODY_TYPE_XML },
+    { ngx_string("+xml"), BODY_TYPE_XML },
+    { ngx_null_string, 0 }
+};
+
+/*
+** @description: This function is called to map a media type to a parser,
+** a later mapping of the same media type replaces the former one.
+** @para: ngx_conf_t *cf
+** @para: ngx_http_yy_sec_waf_body_types_t *bt
+** @para: ngx_str_t *type
+** @para: ngx_uint_t body_type, BODY_TYPE_*.
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_body_types_add(ngx_conf_t *cf,
+    ngx_http_yy_sec_waf_body_types_t *bt, ngx_str_t *type, ngx_uint_t body_type)
+{
+    ngx_uint_t      i;
+    ngx_hash_key_t *hk;
+
+    if (type->len == 0 || type->len > BODY_TYPE_KEY_MAX) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid body type \"%V\"", type);
+        return NGX_ERROR;
+    }
+
+    if (bt->keys == NULL) {
+        bt->keys = ngx_array_create(cf->pool, 16, sizeof(ngx_hash_key_t));
+        if (bt->keys == NULL)
+            return NGX_ERROR;
+    }
+
+    hk = bt->keys->elts;
+
+    for (i = 0; i < bt->keys->nelts; i++) {
+        if (hk[i].key.len == type->len
+            && !ngx_strncasecmp(hk[i].key.data, type->data, type->len))
+        {
+            hk[i].value = (void *) body_type;
+            return NGX_OK;
+        }
+    }
+
+    hk = ngx_array_push(bt->keys);
+    if (hk == NULL)
+        return NGX_ERROR;
+
+    hk->key.data = ngx_pnalloc(cf->pool, type->len);
+    if (hk->key.data == NULL)
+        return NGX_ERROR;
+
+    hk->key.len = type->len;
+    hk->key_hash = ngx_hash_strlow(hk->key.data, type->data, type->len);
+    hk->value = (void *) body_type;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to read a body_type, e.g.
+** body_type application/csp-report json; or body_type image/png none;
+** @para: ngx_conf_t *cf
+** @para: ngx_command_t *cmd
+** @para: void *conf
+** @return: NGX_CONF_OK or NGX_CONF_ERROR if failed.
+*/
+
+static char *
+ngx_http_yy_sec_waf_body_type(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf)
+{
+    ngx_http_yy_sec_waf_loc_conf_t *lcf = conf;
+    ngx_str_t                      *value;
+    ngx_conf_enum_t                *p;
+
+    value = cf->args->elts;
+
+    for (p = body_processors; p->name.len; p++) {
+        if (p->name.len == value[2].len
+            && ngx_strcmp(p->name.data, value[2].data) == 0)
+            break;
+    }
+
+    if (p->name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid body processor \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lcf->body_types == NULL) {
+        lcf->body_types = ngx_pcalloc(cf->pool,
+                              sizeof(ngx_http_yy_sec_waf_body_types_t));
+        if (lcf->body_types == NULL)
+            return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_yy_sec_waf_body_types_add(cf, lcf->body_types,
+                                           &value[1], p->value) != NGX_OK)
+        return NGX_CONF_ERROR;
+
+    return NGX_CONF_OK;
+}
+
+/*
+** @description: This function is called to make the registry of a
+** location, from the default media types, then those of the levels
+** above, then its own body_type.
+** @para: ngx_conf_t *cf
+** @para: ngx_http_yy_sec_waf_body_types_t *bt, those of the location or NULL.
+** @para: ngx_http_yy_sec_waf_body_types_t *prev, those above or NULL.
+** @return: the registry or NULL if failed.
+*/
+
+static ngx_http_yy_sec_waf_body_types_t *
+ngx_http_yy_sec_waf_body_types_merge(ngx_conf_t *cf,
+    ngx_http_yy_sec_waf_body_types_t *bt, ngx_http_yy_sec_waf_body_types_t *prev)
+{
+    ngx_uint_t                        i, j;
+    ngx_conf_enum_t                  *p;
+    ngx_hash_key_t                   *hk;
+    ngx_http_yy_sec_waf_body_types_t *merged, *from[2];
+
+    merged = ngx_pcalloc(cf->pool, sizeof(ngx_http_yy_sec_waf_body_types_t));
+    if (merged == NULL)
+        return NULL;
+
+    for (p = body_default_types; p->name.len; p++) {
+        if (ngx_http_yy_sec_waf_body_types_add(cf, merged, &p->name,
+                                               p->value) != NGX_OK)
+            return NULL;
+    }
+
+    from[0] = prev;
+    from[1] = bt;
+
+    for (i = 0; i < 2; i++) {
+        if (from[i] == NULL || from[i]->keys == NULL)
+            continue;
+
+        hk = from[i]->keys->elts;
+
+        for (j = 0; j < from[i]->keys->nelts; j++) {
+            if (ngx_http_yy_sec_waf_body_types_add(cf, merged, &hk[j].key,
+                                (ngx_uint_t) hk[j].value) != NGX_OK)
+                return NULL;
+        }
+    }
+
+    return merged;
+}
+
+/*
+** @description: This function is called to build the hash of a registry,
+** once per location which has one.
+** @para: ngx_conf_t *cf
+** @para: ngx_http_yy_sec_waf_body_types_t *bt
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_body_types_init(ngx_conf_t *cf,
+    ngx_http_yy_sec_waf_body_types_t *bt)
+{
+    ngx_hash_init_t  hash;
+
+    if (bt->ready)
+        return NGX_OK;
+
+    hash.hash = &bt->hash;
+    hash.key = ngx_hash_key_lc;
+    hash.max_size = 1024;
+    hash.bucket_size = ngx_align(64, ngx_cacheline_size);
+    hash.name = "body_type_hash";
+    hash.pool = cf->pool;
+    hash.temp_pool = NULL;
+
+    if (ngx_hash_init(&hash, bt->keys->elts, bt->keys->nelts) != NGX_OK)
+        return NGX_ERROR;
+
+    bt->ready = 1;
+
+    return NGX_OK;
+}
+
+/* the extensions denied unless "upload_filter extension deny off" */
+static char *upload_deny_extensions[] = {
+    "php", "phtml", "jsp", "jspx", "asp", "aspx", "html", "htm", NULL
+};
+
+/*
+** @description: This function is called to add an extension or a content
+** type to a table of upload_filter.
+** @para: ngx_conf_t *cf
+** @para: ngx_http_yy_sec_waf_upload_filter_t *uf
+** @para: ngx_uint_t table, UPLOAD_*.
+** @para: ngx_str_t *value
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_upload_filter_add(ngx_conf_t *cf,
+    ngx_http_yy_sec_waf_upload_filter_t *uf, ngx_uint_t table, ngx_str_t *value)
+{
+    ngx_str_t       key;
+    ngx_hash_key_t *hk;
+
+    key = *value;
+
+    /* ".php" is the same as "php" */
+    if (table <= UPLOAD_EXTENSION_DENY && key.len && key.data[0] == '.') {
+        key.data++;
+        key.len--;
+    }
+
+    if (key.len == 0 || key.len > UPLOAD_KEY_MAX) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid upload filter \"%V\"", value);
+        return NGX_ERROR;
+    }
+
+    if (uf->keys[table] == NULL) {
+        uf->keys[table] = ngx_array_create(cf->pool, 8, sizeof(ngx_hash_key_t));
+        if (uf->keys[table] == NULL)
+            return NGX_ERROR;
+    }
+
+    hk = ngx_array_push(uf->keys[table]);
+    if (hk == NULL)
+        return NGX_ERROR;
+
+    hk->key.data = ngx_pnalloc(cf->pool, key.len);
+    if (hk->key.data == NULL)
+        return NGX_ERROR;
+
+    hk->key.len = key.len;
+    hk->key_hash = ngx_hash_strlow(hk->key.data, key.data, key.len);
+    hk->value = (void *) 1;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to read an upload_filter, e.g.
+** upload_filter extension deny php jsp; or
+** upload_filter content_type allow image/png image/jpeg;
+** A table starts from the defaults, "off" empties it.
+** @para: ngx_conf_t *cf
+** @para: ngx_command_t *cmd
+** @para: void *conf
+** @return: NGX_CONF_OK or NGX_CONF_ERROR if failed.
+*/
+
+static char *
+ngx_http_yy_sec_waf_upload_filter(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf)
+{
+    ngx_http_yy_sec_waf_loc_conf_t *lcf = conf;
+    ngx_str_t                      *value;
+    ngx_uint_t                      i, table;
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts < 4) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of arguments in \"upload_filter\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_strcmp(value[1].data, "extension") == 0) {
+        table = UPLOAD_EXTENSION_ALLOW;
+    } else if (ngx_strcmp(value[1].data, "content_type") == 0) {
+        table = UPLOAD_CONTENT_TYPE_ALLOW;
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid upload filter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_strcmp(value[2].data, "deny") == 0) {
+        table++;
+    } else if (ngx_strcmp(value[2].data, "allow") != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid upload filter \"%V\"", &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (lcf->upload_filter == NULL) {
+        lcf->upload_filter = ngx_http_yy_sec_waf_upload_filter_default(cf);
+        if (lcf->upload_filter == NULL)
+            return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts == 4 && ngx_strcmp(value[3].data, "off") == 0) {
+        lcf->upload_filter->keys[table] = NULL;
+        return NGX_CONF_OK;
+    }
+
+    for (i = 3; i < cf->args->nelts; i++) {
+        if (ngx_http_yy_sec_waf_upload_filter_add(cf, lcf->upload_filter,
+                                                  table, &value[i]) != NGX_OK)
+            return NGX_CONF_ERROR;
+    }
+
     return NGX_CONF_OK;
 }
 
+/*
+** @description: This function is called to make the tables of a location
+** with the default extensions denied.
+** @para: ngx_conf_t *cf
+** @return: the tables or NULL if failed.
+*/
+
+static ngx_http_yy_sec_waf_upload_filter_t *
+ngx_http_yy_sec_waf_upload_filter_default(ngx_conf_t *cf)
+{
+    char                               **ext;
+    ngx_str_t                            value;
+    ngx_http_yy_sec_waf_upload_filter_t *uf;
+
+    uf = ngx_pcalloc(cf->pool, sizeof(ngx_http_yy_sec_waf_upload_filter_t));
+    if (uf == NULL)
+        return NULL;
+
+    for (ext = upload_deny_extensions; *ext; ext++) {
+        value.data = (u_char *) *ext;
+        value.len = ngx_strlen(*ext);
+
+        if (ngx_http_yy_sec_waf_upload_filter_add(cf, uf, UPLOAD_EXTENSION_DENY,
+                                                  &value) != NGX_OK)
+            return NULL;
+    }
+
+    return uf;
+}
+
+/*
+** @description: This function is called to build the hashes of the tables
+** of upload_filter, once per location which has them.
+** @para: ngx_conf_t *cf
+** @para: ngx_http_yy_sec_waf_upload_filter_t *uf
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_upload_filter_init(ngx_conf_t *cf,
+    ngx_http_yy_sec_waf_upload_filter_t *uf)
+{
+    ngx_uint_t       i;
+    ngx_hash_init_t  hash;
+
+    if (uf->ready)
+        return NGX_OK;
+
+    for (i = 0; i < 4; i++) {
+        if (uf->keys[i] == NULL)
+            continue;
+
+        hash.hash = &uf->hash[i];
+        hash.key = ngx_hash_key_lc;
+        hash.max_size = 1024;
+        hash.bucket_size = ngx_align(64, ngx_cacheline_size);
+        hash.name = "upload_filter_hash";
+        hash.pool = cf->pool;
+        hash.temp_pool = NULL;
+
+        if (ngx_hash_init(&hash, uf->keys[i]->elts, uf->keys[i]->nelts) != NGX_OK)
+            return NGX_ERROR;
+    }
+
+    uf->ready = 1;
+
+    return NGX_OK;
+}
+
 /*
 ** @description: This function is called before configuration of yy sec waf.
 ** @para: ngx_conf_t *cf
@@ -229,7 +897,92 @@ ngx_http_yy_sec_waf_header_filter(ngx_http_request_t *r)
 }
 
 /*
-** @description: This function is called to filter body.
+** @description: This function is called to run the response body rules
+** on a buffer of the response. RESPONSE_BODY refers to the buffer, and to
+** the seam of the former buffer and this one, the only bytes copied.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_loc_conf_t *cf
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_buf_t *b
+** @return: NGX_DECLINED, NGX_ERROR or the result of the matched rule.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_response_body(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx,
+    ngx_buf_t *b)
+{
+    size_t     len, n;
+    ngx_int_t  rc;
+    ngx_str_t  key, value;
+
+    if (ctx->response_seam == NULL) {
+        ctx->response_seam = ngx_pnalloc(r->pool, 2 * RESPONSE_BODY_OVERLAP);
+        if (ctx->response_seam == NULL)
+            return NGX_ERROR;
+    }
+
+    len = b->last - b->pos;
+
+    /*
+    ** upstream buffers are reused at the same address, and the seam always
+    ** is, so tfn results of the former buffers mustn't be found in the cache
+    */
+    ctx->tfn_generation++;
+
+    /* the seam is the tail of the former buffers and the head of this one */
+    n = ngx_min(len, RESPONSE_BODY_OVERLAP);
+    ngx_memcpy(ctx->response_seam + ctx->response_tail, b->pos, n);
+
+    ngx_str_null(&key);
+
+    if (ctx->response_tail) {
+        value.data = ctx->response_seam;
+        value.len = ctx->response_tail + n;
+
+        if (ngx_yy_sec_waf_collection_push(r->pool, &ctx->response_body,
+                                           &key, &value) == NULL)
+            return NGX_ERROR;
+    }
+
+    value.data = b->pos;
+    value.len = len;
+
+    if (ngx_yy_sec_waf_collection_push(r->pool, &ctx->response_body,
+                                       &key, &value) == NULL)
+        return NGX_ERROR;
+
+    rc = yy_sec_waf_re_process_normal_rules(r, cf, ctx, RESPONSE_BODY_PHASE);
+
+    /* the buffer belongs to the next filters from now on */
+    ngx_yy_sec_waf_collection_reset(&ctx->response_body);
+
+    if (len >= RESPONSE_BODY_OVERLAP) {
+        ngx_memcpy(ctx->response_seam, b->last - RESPONSE_BODY_OVERLAP,
+                   RESPONSE_BODY_OVERLAP);
+        ctx->response_tail = RESPONSE_BODY_OVERLAP;
+
+    } else {
+        /* a short buffer is all in the seam, after the former tail */
+        n = ctx->response_tail + len;
+
+        if (n > RESPONSE_BODY_OVERLAP) {
+            ngx_memmove(ctx->response_seam,
+                        ctx->response_seam + n - RESPONSE_BODY_OVERLAP,
+                        RESPONSE_BODY_OVERLAP);
+            n = RESPONSE_BODY_OVERLAP;
+        }
+
+        ctx->response_tail = n;
+    }
+
+    return rc;
+}
+
+/*
+** @description: This function is called to filter body. The response body
+** rules run once per buffer in memory when they look at RESPONSE_BODY,
+** else once per response. Buffers in files only aren't inspected.
 ** @para: ngx_http_request_t *r
 ** @para: ngx_chain_t *in
 ** @return: NGX_CONF_OK or NGX_CONF_ERROR if failed.
@@ -239,6 +992,7 @@ static ngx_int_t
 ngx_http_yy_sec_waf_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
 {
     ngx_int_t                       rc;
+    ngx_chain_t                    *cl;
     ngx_http_request_ctx_t         *ctx;
     ngx_http_yy_sec_waf_loc_conf_t *cf;
 
@@ -256,8 +1010,35 @@ ngx_http_yy_sec_waf_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
         return ngx_http_next_body_filter(r, in);
     }
 
-    if (r == r->main && ctx && !ctx->process_done) {
-        rc = yy_sec_waf_re_process_normal_rules(r, cf, ctx, RESPONSE_BODY_PHASE);
+    if (r != r->main || ctx == NULL || ctx->process_done
+        || cf->response_body_rules == NULL)
+    {
+        return ngx_http_next_body_filter(r, in);
+    }
+
+    if (!(cf->var_flags & VAR_NEED_RESPONSE_BODY)) {
+        if (!ctx->response_body_done) {
+            ctx->response_body_done = 1;
+
+            rc = yy_sec_waf_re_process_normal_rules(r, cf, ctx, RESPONSE_BODY_PHASE);
+            if (rc != NGX_DECLINED) {
+                return ngx_http_filter_finalize_request(r, &ngx_http_yy_sec_waf_module, rc);
+            }
+        }
+
+        return ngx_http_next_body_filter(r, in);
+    }
+
+    for (cl = in; cl && !ctx->process_done; cl = cl->next) {
+        if (!ngx_buf_in_memory(cl->buf) || cl->buf->pos == cl->buf->last) {
+            continue;
+        }
+
+        rc = ngx_http_yy_sec_waf_response_body(r, cf, ctx, cl->buf);
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
         if (rc != NGX_DECLINED) {
             return ngx_http_filter_finalize_request(r, &ngx_http_yy_sec_waf_module, rc);
         }
@@ -266,6 +1047,76 @@ ngx_http_yy_sec_waf_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
     return ngx_http_next_body_filter(r, in);
 }
 
+/*
+** @description: This function is called to process the body rules. When the
+** body is streamed they run once per body buffer, on the new elements only.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_loc_conf_t *cf
+** @para: ngx_http_request_ctx_t *ctx
+** @return: NGX_DECLINED or the result of the matched rule.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_process_body_rules(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_loc_conf_t *cf, ngx_http_request_ctx_t *ctx)
+{
+    ngx_int_t rc;
+
+    rc = yy_sec_waf_re_process_normal_rules(r, cf, ctx, REQUEST_BODY_PHASE);
+
+    ngx_http_yy_sec_waf_body_checked(ctx);
+
+    return rc;
+}
+
+#if (YY_SEC_WAF_REQUEST_BODY_FILTER)
+
+/*
+** @description: This function is called to filter the request body as it is
+** read. Each buffer is parsed and checked by the body rules at once, so a
+** request can be rejected before the rest of its body is read.
+** @para: ngx_http_request_t *r
+** @para: ngx_chain_t *in
+** @return: the result of the next filter, or the status to reject with.
+*/
+
+static ngx_int_t
+ngx_http_yy_sec_waf_request_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
+{
+    ngx_int_t                       rc;
+    ngx_http_request_ctx_t         *ctx;
+    ngx_http_yy_sec_waf_loc_conf_t *cf;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_yy_sec_waf_module);
+
+    /* the rest of the body past the inspection window is passed on as is */
+    if (ctx == NULL || !ctx->body_streaming || ctx->process_done
+        || ctx->body_truncated)
+    {
+        return ngx_http_next_request_body_filter(r, in);
+    }
+
+    cf = ngx_http_get_module_loc_conf(r, ngx_http_yy_sec_waf_module);
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] ngx_http_yy_sec_waf_request_body_filter Entry");
+
+    /* errors of the body are left to the PROCESS_BODY_ERROR rules */
+    if (ngx_http_yy_sec_waf_body_feed(r, ctx, in) == NGX_ERROR
+        && !ctx->process_body_error)
+    {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    rc = ngx_http_yy_sec_waf_process_body_rules(r, cf, ctx);
+    if (rc != NGX_DECLINED) {
+        return rc;
+    }
+
+    return ngx_http_next_request_body_filter(r, in);
+}
+
+#endif
+
 /*
 ** @description: This function is called to init yy sec waf in process of postconfiguration.
 ** @para: ngx_conf_t *cf
@@ -280,6 +1131,10 @@ ngx_http_yy_sec_waf_init(ngx_conf_t *cf)
 
     cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
 
+    if (ngx_http_yy_sec_waf_magic_init(cf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     h = ngx_array_push(&cmcf->phases[NGX_HTTP_REWRITE_PHASE].handlers);
 
     if (h == NULL) {
@@ -294,6 +1149,11 @@ ngx_http_yy_sec_waf_init(ngx_conf_t *cf)
     ngx_http_next_body_filter = ngx_http_top_body_filter;
     ngx_http_top_body_filter = ngx_http_yy_sec_waf_body_filter;
 
+#if (YY_SEC_WAF_REQUEST_BODY_FILTER)
+    ngx_http_next_request_body_filter = ngx_http_top_request_body_filter;
+    ngx_http_top_request_body_filter = ngx_http_yy_sec_waf_request_body_filter;
+#endif
+
     return NGX_OK;
 }
 
@@ -339,41 +1199,73 @@ ngx_http_yy_sec_waf_handler(ngx_http_request_t *r)
         return NGX_DECLINED;
     }
 
-    ctx = ngx_http_yy_sec_waf_create_ctx(r, cf);
-
+    /* the ctx is there already when we're back from reading the body */
     if (ctx == NULL) {
-        return NGX_ERROR;
-    }
+        ctx = ngx_http_yy_sec_waf_create_ctx(r, cf);
 
-    ngx_http_set_ctx(r, ctx, ngx_http_yy_sec_waf_module);
+        if (ctx == NULL) {
+            return NGX_ERROR;
+        }
 
-    if (cf->conn_processor) {
-        rc = ngx_http_yy_sec_waf_process_conn(ctx);
+        ngx_http_set_ctx(r, ctx, ngx_http_yy_sec_waf_module);
 
-        if (rc != NGX_OK) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "[ysec_waf] ngx_http_yy_sec_waf_process_conn failed");
-            return rc;
+        if (cf->conn_processor) {
+            rc = ngx_http_yy_sec_waf_process_conn(ctx);
+
+            if (rc != NGX_OK) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "[ysec_waf] ngx_http_yy_sec_waf_process_conn failed");
+                return rc;
+            }
+        }
+
+        /*
+        ** The uri and the headers are checked before the body is read. A
+        ** blocked request is answered at once, and nginx discards its body
+        ** when it sends the special response.
+        */
+        if (r == r->main) {
+            rc = yy_sec_waf_re_process_normal_rules(r, cf, ctx, REQUEST_HEADER_PHASE);
+            if (rc != NGX_DECLINED) {
+                return rc;
+            }
+
+            /* a match which only logs doesn't keep the body from its rules */
+            ctx->header_matched = ctx->process_done;
+            ctx->process_done = 0;
         }
     }
 
 
     /* This section is prepared for further considerations, such as checking the body of this request.*/
-    if ((r->method == NGX_HTTP_POST || r->method == NGX_HTTP_PUT) && !ctx->read_body_done) {
+    if ((r->method == NGX_HTTP_POST || r->method == NGX_HTTP_PUT)
+        && cf->body_needed && !ctx->read_body_done)
+    {
+
+#if (YY_SEC_WAF_REQUEST_BODY_FILTER)
+        /* the denied url can't be redirected to while the body is read */
+        if (cf->body_processor && cf->body_streaming && cf->denied_url == NULL
+            && ngx_http_yy_sec_waf_body_init(r, ctx) == NGX_OK)
+        {
+            ctx->body_streaming = 1;
+        }
+#endif
+
         rc = ngx_http_read_client_request_body(r, ngx_http_yy_sec_waf_request_body_handler);
 
         if (rc == NGX_AGAIN) {
             ctx->waiting_more_body = 1;
             return NGX_DONE;
         } else if (rc >= NGX_HTTP_SPECIAL_RESPONSE || rc == NGX_ERROR) {
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,"[ysec_waf] ngx_http_read_client_request_body failed: %d", rc);
+            if (!ctx->process_done) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,"[ysec_waf] ngx_http_read_client_request_body failed: %d", rc);
+            }
             return rc;
         }
     } else {
         ctx->read_body_done = 1;
     }
 
-    if (r == r->main && ctx && ctx->read_body_done && !ctx->process_done) {
-        rc = NGX_DECLINED;
+    if (r == r->main && ctx->read_body_done && !ctx->process_done) {
 
         if (cf->body_processor 
             && (r->method == NGX_HTTP_POST || r->method == NGX_HTTP_PUT)
@@ -384,18 +1276,14 @@ ngx_http_yy_sec_waf_handler(ngx_http_request_t *r)
             }
         }
 
-        //Temply hack here, should hook the input filters.
-        rc = yy_sec_waf_re_process_normal_rules(r, cf, ctx, REQUEST_HEADER_PHASE);
-        if (rc != NGX_DECLINED) {
-            return rc;
-        }
-
-        rc = yy_sec_waf_re_process_normal_rules(r, cf, ctx, REQUEST_BODY_PHASE);
+        rc = ngx_http_yy_sec_waf_process_body_rules(r, cf, ctx);
         if (rc != NGX_DECLINED) {
             return rc;
         }
+    }
 
-        return rc;
+    if (ctx->header_matched) {
+        ctx->process_done = 1;
     }
 
     return NGX_DECLINED;
@@ -449,22 +1337,15 @@ ngx_http_yy_sec_waf_create_ctx(ngx_http_request_t *r,
         return NULL;
     }
 
-    ctx->args.len = r->args.len;
-    ctx->args.data = ngx_pcalloc(r->pool, r->args.len);
-    if (ctx->args.data == NULL) {
-        return NULL;
+    /* the query string is parsed on demand, see ngx_http_yy_sec_waf_process_args */
+    if (!(cf->var_flags & VAR_NEED_ARGS)) {
+        ctx->args_done = 1;
     }
 
-    ngx_memcpy(ctx->args.data, r->args.data, ctx->args.len);
-
-    ngx_http_yy_sec_waf_process_spliturl(r, &ctx->args, ctx, PROCESS_ARGS);
-
     ctx->process_body_error = 0;
 
     if (r->method == NGX_HTTP_POST || r->method == NGX_HTTP_PUT) {
 
-        ngx_array_init(&ctx->multipart_name, r->pool, 2, sizeof(ngx_str_t));
-        ngx_array_init(&ctx->multipart_filename, r->pool, 2, sizeof(ngx_str_t));
         ngx_array_init(&ctx->content_type, r->pool, 2, sizeof(ngx_str_t));
     }
 
@@ -490,7 +1371,7 @@ ngx_http_yy_sec_waf_create_ctx(ngx_http_request_t *r,
     #endif
 #endif
 
-    //yy_sec_waf_re_cache_init_rbtree(&ctx->cache_rbtree, &ctx->cache_sentinel);
+    yy_sec_waf_re_cache_init_rbtree(&ctx->cache_rbtree, &ctx->cache_sentinel);
 
     return ctx;
 }
@@ -10,6 +10,17 @@
 
 static yy_sec_waf_re_t *rule_engine;
 
+/*
+** identifies one transformation of one value in the per-request cache,
+** the generation tells apart values at memory which has been reused
+*/
+typedef struct {
+    u_char           *data;
+    size_t            len;
+    re_tfns_metadata *tfn;
+    ngx_uint_t        generation;
+} re_tfn_cache_key_t;
+
 extern ngx_int_t ngx_local_addr(const char *eth, ngx_str_t *s);
 
 /*
@@ -87,6 +98,30 @@ yy_sec_waf_re_resolve_action_in_hash(ngx_str_t *action)
     return metadata;
 }
 
+/*
+** @description: This function is called to resolve collections in hash.
+** The name is looked up in lowercase without changing it, since it is
+** still needed as an nginx variable name if it is no collection.
+** @para: ngx_str_t *name
+** @return: static re_collection_metadata *
+*/
+
+static re_collection_metadata *
+yy_sec_waf_re_resolve_collection_in_hash(ngx_str_t *name)
+{
+    u_char      lowcase[32];
+    ngx_uint_t  key;
+
+    if (name == NULL || name->len > sizeof(lowcase)) {
+        return NULL;
+    }
+
+    key = ngx_hash_strlow(lowcase, name->data, name->len);
+
+    return (re_collection_metadata *) ngx_hash_find(
+        &rule_engine->collections_in_hash, key, lowcase, name->len);
+}
+
 /*
 ** @description: This function is called to redirect request url to the denied url of yy sec waf.
 ** @para: ngx_http_request_t *r
@@ -156,6 +191,48 @@ yy_sec_waf_output_forbidden_page(ngx_http_request_t *r,
     }
 }
 
+/*
+** @description: This function is called to execute the tfn of a rule on ctx->var.
+** The result is cached per request, so rules sharing a tfn and a variable
+** transform it only once.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_rule_t *rule
+** @para: ngx_http_request_ctx_t *ctx
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+yy_sec_waf_re_execute_tfn(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_rule_t *rule, ngx_http_request_ctx_t *ctx)
+{
+    ngx_str_t           name, *cached;
+    re_tfn_cache_key_t  key;
+
+    ngx_memzero(&key, sizeof(re_tfn_cache_key_t));
+
+    key.data = ctx->var.data;
+    key.len = ctx->var.len;
+    key.tfn = rule->tfn_metadata;
+    key.generation = ctx->tfn_generation;
+
+    name.data = (u_char *) &key;
+    name.len = sizeof(re_tfn_cache_key_t);
+
+    cached = yy_sec_waf_re_cache_get_value(&ctx->cache_rbtree, &name);
+
+    if (cached != NULL) {
+        ctx->var = *cached;
+        return NGX_OK;
+    }
+
+    if (key.tfn->execute(r, &ctx->var) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return yy_sec_waf_re_cache_set_value(r->pool, &name, &ctx->var,
+                                         &ctx->cache_rbtree);
+}
+
 /*
 ** @description: This function is called to execute operator.
 ** @para: ngx_http_request_t *r
@@ -191,6 +268,53 @@ yy_sec_waf_re_execute_operator(ngx_http_request_t *r,
     return RULE_NO_MATCH;
 }
 
+/*
+** @description: This function is called to get the matched value for the
+** error log, with CR and LF replaced so that it stays on one line.
+** @para: ngx_http_request_ctx_t *ctx
+** @return: static ngx_str_t *
+*/
+
+static ngx_str_t *
+yy_sec_waf_re_log_var(ngx_http_request_ctx_t *ctx)
+{
+    u_char    *p, *last;
+    ngx_str_t *var;
+
+    if (ctx->process_body_error) {
+        return &ctx->process_body_error_msg;
+    }
+
+    last = ctx->var.data + ctx->var.len;
+
+    if (ngx_strlchr(ctx->var.data, last, '\n') == NULL
+        && ngx_strlchr(ctx->var.data, last, '\r') == NULL)
+    {
+        return &ctx->var;
+    }
+
+    var = ngx_palloc(ctx->r->pool, sizeof(ngx_str_t));
+    if (var == NULL) {
+        return &ctx->var;
+    }
+
+    var->len = ctx->var.len;
+    var->data = ngx_pnalloc(ctx->r->pool, var->len);
+    if (var->data == NULL) {
+        return &ctx->var;
+    }
+
+    ngx_memcpy(var->data, ctx->var.data, var->len);
+
+    for (p = var->data; p < var->data + var->len; p++) {
+        if (*p == '\n' || *p == '\r') {
+            *p = ' ';
+        }
+    }
+
+    return var;
+}
+
 /*
 ** @description: This function is called to perform interception.
 ** @para: ngx_http_request_ctx_t *ctx
@@ -224,7 +348,7 @@ yy_sec_waf_re_perform_interception(ngx_http_request_ctx_t *ctx)
             (ctx->action_level & ACTION_ALLOW)? "allow": "alert",
             ctx->rule_id, ctx->conn_per_ip,
             *request_matched, *request_blocked, *request_allowed, *request_logged,
-            ctx->process_body_error? &ctx->process_body_error_msg: &ctx->var,
+            yy_sec_waf_re_log_var(ctx),
             ctx->real_client_ip, ctx->server_ip);
     }
 
@@ -234,47 +358,198 @@ yy_sec_waf_re_perform_interception(ngx_http_request_ctx_t *ctx)
     return NGX_DECLINED;
 }
 
+/*
+** @description: This function is called to run the tfn and the operator
+** of a rule on ctx->var.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_rule_t *rule
+** @para: ngx_http_request_ctx_t *ctx
+** @return: RULE_MATCH or RULE_NO_MATCH if failed.
+*/
+
+static ngx_int_t
+yy_sec_waf_re_process_var(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_rule_t *rule, ngx_http_request_ctx_t *ctx)
+{
+    if (rule->tfn_metadata != NULL
+        && yy_sec_waf_re_execute_tfn(r, rule, ctx) != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] id:%d, var:%V", rule->rule_id, &ctx->var);
+
+    return yy_sec_waf_re_execute_operator(r, rule, ctx);
+}
+
+/*
+** @description: This function is called to process a rule on one element
+** of a collection.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_rule_t *rule
+** @para: ngx_uint_t type
+** @para: ngx_http_yy_sec_waf_elt_t *elt
+** @para: ngx_http_request_ctx_t *ctx
+** @return: RULE_MATCH or RULE_NO_MATCH if failed.
+*/
+
+static ngx_int_t
+yy_sec_waf_re_process_elt(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_rule_t *rule, ngx_uint_t type,
+    ngx_http_yy_sec_waf_elt_t *elt, ngx_http_request_ctx_t *ctx)
+{
+    switch (type) {
+        case COLLECTION_NAMES:
+            ctx->var = elt->key;
+            break;
+        case COLLECTION_LENGTH:
+            ctx->var.data = ctx->var_buf;
+            ctx->var.len = ngx_sprintf(ctx->var_buf, "%uz", elt->value.len)
+                           - ctx->var_buf;
+
+            /* var_buf is reused for every element, so no tfn cache here */
+            return yy_sec_waf_re_execute_operator(r, rule, ctx);
+        default:
+            ctx->var = elt->value;
+            break;
+    }
+
+    if (ctx->var.len == 0) {
+        return RULE_NO_MATCH;
+    }
+
+    return yy_sec_waf_re_process_var(r, rule, ctx);
+}
+
+/*
+** @description: This function is called to process a rule on a collection,
+** either on all elements or on the elements of the selected name only.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_yy_sec_waf_rule_t *rule
+** @para: ngx_http_yy_sec_waf_rule_var_t *var
+** @para: ngx_http_request_ctx_t *ctx
+** @return: RULE_MATCH, RULE_NO_MATCH or NGX_AGAIN if there is no element.
+*/
+
+static ngx_int_t
+yy_sec_waf_re_process_collection(ngx_http_request_t *r,
+    ngx_http_yy_sec_waf_rule_t *rule, ngx_http_yy_sec_waf_rule_var_t *var,
+    ngx_http_request_ctx_t *ctx)
+{
+    ngx_int_t                         rc;
+    ngx_uint_t                        i, start, found;
+    re_collection_metadata           *metadata;
+    ngx_http_yy_sec_waf_elt_t        *elt;
+    ngx_http_yy_sec_waf_collection_t *c;
+
+    metadata = var->collection;
+
+    c = metadata->get(r, ctx);
+
+    if (c == NULL) {
+        return NGX_AGAIN;
+    }
+
+    /* a streamed body is checked once per buffer, skip what was checked */
+    start = (ctx->phase == REQUEST_BODY_PHASE)? c->checked: 0;
+
+    if (c->elts.nelts <= start) {
+        return NGX_AGAIN;
+    }
+
+    if (var->key.len) {
+        found = 0;
+
+        for (elt = ngx_yy_sec_waf_collection_find(r->pool, c, &var->key, NULL);
+             elt;
+             elt = ngx_yy_sec_waf_collection_find(r->pool, c, &var->key, elt))
+        {
+            if ((ngx_uint_t) (elt - (ngx_http_yy_sec_waf_elt_t *) c->elts.elts) < start) {
+                continue;
+            }
+
+            found = 1;
+
+            rc = yy_sec_waf_re_process_elt(r, rule, metadata->type, elt, ctx);
+            if (rc == NGX_ERROR || rc == RULE_MATCH) {
+                return rc;
+            }
+        }
+
+        return found? RULE_NO_MATCH: NGX_AGAIN;
+    }
+
+    elt = c->elts.elts;
+
+    for (i = start; i < c->elts.nelts; i++) {
+        rc = yy_sec_waf_re_process_elt(r, rule, metadata->type, &elt[i], ctx);
+        if (rc == NGX_ERROR || rc == RULE_MATCH) {
+            return rc;
+        }
+    }
+
+    return RULE_NO_MATCH;
+}
+
 /*
 ** @description: This function is called to process rule for yy sec waf.
 ** @para: ngx_http_request_t *r
 ** @para: ngx_http_yy_sec_waf_loc_conf_t *cf
 ** @para: ngx_http_request_ctx_t *ctx
-** @return: RULE_MATCH or RULE_NO_MATCH if failed.
+** @return: RULE_MATCH, RULE_NO_MATCH or NGX_AGAIN if no target has a value.
 */
 
 static ngx_int_t
 yy_sec_waf_re_process_rule(ngx_http_request_t *r,
     ngx_http_yy_sec_waf_rule_t *rule, ngx_http_request_ctx_t *ctx)
 {
-    ngx_int_t                   rc, *var_index_p;
-    ngx_uint_t                  i;
-    ngx_http_variable_value_t  *vv;
+    ngx_int_t                       rc, found;
+    ngx_uint_t                      i;
+    ngx_http_variable_value_t      *vv;
+    ngx_http_yy_sec_waf_rule_var_t *var;
 
 	if (rule == NULL)
 		return NGX_AGAIN;
 
-    var_index_p = rule->var_index.elts;
+    var = rule->vars.elts;
+    found = 0;
 
-    for (i = 0; i < rule->var_index.nelts; i++) {
+    for (i = 0; i < rule->vars.nelts; i++) {
 
-        vv = ngx_http_get_flushed_variable(r, var_index_p[i]);
+        if (var[i].collection != NULL) {
+            rc = yy_sec_waf_re_process_collection(r, rule, &var[i], ctx);
+
+            /* An empty collection or a missing key leaves the other targets. */
+            if (rc == NGX_AGAIN) {
+                continue;
+            }
+
+            if (rc != RULE_NO_MATCH) {
+                return rc;
+            }
+
+            found = 1;
+            continue;
+        }
+
+        vv = ngx_http_get_flushed_variable(r, var[i].index);
     
         if (vv == NULL || vv->not_found || vv->len == 0) {
-            return NGX_AGAIN;
+            continue;
         }
 
+        found = 1;
+
         ctx->var.data = vv->data;
         ctx->var.len = vv->len;
 
-        ngx_log_debug(NGX_LOG_DEBUG_HTTP, r->connection->log, 0, "[ysec_waf] id:%d, var:%V", rule->rule_id, &ctx->var);
-
-        rc = yy_sec_waf_re_execute_operator(r, rule, ctx);
+        rc = yy_sec_waf_re_process_var(r, rule, ctx);
         if (rc == NGX_ERROR || rc == RULE_MATCH) {
             return rc;
         }
     }
 
-    return RULE_NO_MATCH;
+    return found? RULE_NO_MATCH: NGX_AGAIN;
 }
 
 /*
@@ -398,23 +673,24 @@ static char *
 yy_sec_waf_re_parse_variables(ngx_conf_t *cf,
     ngx_str_t *value, ngx_http_yy_sec_waf_rule_t *rule)
 {
-    ngx_str_t variable;
-    ngx_int_t len, var_index, *var_index_p;
-    u_char   *start, *last, *end;
+    ngx_str_t                       variable;
+    u_char                         *start, *last, *end, *colon;
+    ngx_http_yy_sec_waf_rule_var_t *var;
 
     if (value == NULL) {
         return NGX_CONF_ERROR;
     }
 
-    ngx_memcpy(&variable, value, sizeof(ngx_str_t));
-
-    ngx_array_init(&rule->var_index, cf->pool, 1, sizeof(ngx_int_t));
+    if (ngx_array_init(&rule->vars, cf->pool, 1,
+                       sizeof(ngx_http_yy_sec_waf_rule_var_t)) != NGX_OK)
+    {
+        return NGX_CONF_ERROR;
+    }
 
-    len = variable.len;
-    start = variable.data;
-    last = variable.data+variable.len;
+    start = value->data;
+    last = value->data + value->len;
 
-    while(len > 0 && *start) {
+    while (start < last && *start) {
 
         if (*start == '|' || *start == '$'){
             start++;
@@ -426,22 +702,39 @@ yy_sec_waf_re_parse_variables(ngx_conf_t *cf,
             end = last;
         }
 
+        var = ngx_array_push(&rule->vars);
+        if (var == NULL)
+            return NGX_CONF_ERROR;
+
+        ngx_memzero(var, sizeof(ngx_http_yy_sec_waf_rule_var_t));
+
         variable.data = start;
         variable.len = end - start;
 
-        var_index = ngx_http_get_variable_index(cf, &variable);
-        if (var_index == NGX_ERROR) {
-            return NGX_CONF_ERROR;
+        /* COLLECTION:key */
+        colon = ngx_strlchr(start, end, ':');
+        if (colon != NULL) {
+            variable.len = colon - start;
+            var->key.data = colon + 1;
+            var->key.len = end - colon - 1;
         }
 
-        var_index_p = ngx_array_push(&rule->var_index);
-        if (var_index_p == NULL)
-            return NGX_CONF_ERROR;
+        var->collection = yy_sec_waf_re_resolve_collection_in_hash(&variable);
 
-        *var_index_p = var_index;
+        if (var->collection == NULL) {
+            if (colon != NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                    "[ysec_waf] unknown collection \"%V\"", &variable);
+                return NGX_CONF_ERROR;
+            }
+
+            var->index = ngx_http_get_variable_index(cf, &variable);
+            if (var->index == NGX_ERROR) {
+                return NGX_CONF_ERROR;
+            }
+        }
 
         start = end+1;
-        len = last - start;
     }
 
     return NGX_CONF_OK;
@@ -711,6 +1004,10 @@ ngx_http_yy_sec_waf_re_create(ngx_conf_t *cf)
             &rule_engine->tfns_in_hash) == NGX_ERROR)
         return NGX_ERROR;
 
+    if (ngx_http_yy_sec_waf_init_collections_in_hash(cf,
+            &rule_engine->collections_in_hash) == NGX_ERROR)
+        return NGX_ERROR;
+
     return NGX_OK;
 }
 
@@ -59,13 +59,29 @@ typedef struct {
     fn_op_execute_t execute;
 } re_op_metadata;
 
-typedef ngx_int_t (*fn_tfns_execute_t)(ngx_http_variable_value_t *v);
+typedef ngx_int_t (*fn_tfns_execute_t)(ngx_http_request_t *r,
+    ngx_str_t *str);
 
 typedef struct {
     const ngx_str_t name;
     fn_tfns_execute_t execute;
 } re_tfns_metadata;
 
+/* what of a collection element a rule looks at */
+#define COLLECTION_VALUES          0
+#define COLLECTION_NAMES           1
+#define COLLECTION_LENGTH          2
+
+typedef ngx_http_yy_sec_waf_collection_t *(*fn_collection_get_t)(
+    ngx_http_request_t *r, ngx_http_request_ctx_t *ctx);
+
+typedef struct {
+    const ngx_str_t name;
+    fn_collection_get_t get;
+    ngx_uint_t type;   /* COLLECTION_* */
+    ngx_uint_t need;   /* VAR_NEED_* */
+} re_collection_metadata;
+
 typedef void* (*fn_action_parse_t)(ngx_conf_t *cf,
     ngx_str_t *tmp, ngx_http_yy_sec_waf_rule_t *rule);
 
@@ -78,6 +94,7 @@ typedef struct {
     ngx_hash_t operators_in_hash;
     ngx_hash_t actions_in_hash;
     ngx_hash_t tfns_in_hash;
+    ngx_hash_t collections_in_hash;
 } yy_sec_waf_re_t;
 
 ngx_int_t ngx_http_yy_sec_waf_add_variables(ngx_conf_t *cf);
@@ -91,15 +108,18 @@ ngx_int_t ngx_http_yy_sec_waf_init_actions_in_hash(ngx_conf_t *cf,
 ngx_int_t ngx_http_yy_sec_waf_init_tfns_in_hash(ngx_conf_t *cf,
     ngx_hash_t *hash);
 
+ngx_int_t ngx_http_yy_sec_waf_init_collections_in_hash(ngx_conf_t *cf,
+    ngx_hash_t *hash);
+
 re_tfns_metadata *yy_sec_waf_re_resolve_tfn_in_hash(ngx_str_t *tfn);
 
-ngx_inline void yy_sec_waf_re_cache_init_rbtree(ngx_rbtree_t *rbtree,
+void yy_sec_waf_re_cache_init_rbtree(ngx_rbtree_t *rbtree,
     ngx_rbtree_node_t *sentinel);
 
 ngx_int_t yy_sec_waf_re_cache_set_value(ngx_pool_t *pool,
-    ngx_str_t *name, ngx_array_t *value, ngx_rbtree_t *rbtree);
+    ngx_str_t *name, ngx_str_t *value, ngx_rbtree_t *rbtree);
 
-ngx_inline ngx_str_t *yy_sec_waf_re_cache_get_value(ngx_rbtree_t *rbtree,
+ngx_str_t *yy_sec_waf_re_cache_get_value(ngx_rbtree_t *rbtree,
     ngx_str_t *name);
 
 #endif
@@ -208,6 +208,11 @@ yy_sec_waf_parse_tfn(ngx_conf_t *cf,
 
     rule->tfn_metadata = yy_sec_waf_re_resolve_tfn_in_hash(tfn);
 
+    if (rule->tfn_metadata == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "[ysec_waf] unknown tfn \"%V\"", tfn);
+        return NGX_CONF_ERROR;
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -10,22 +10,38 @@
 
 typedef struct {
     ngx_str_node_t sn;
-    ngx_array_t   *value;
+    ngx_str_t      value;
 } re_cache_node_t;
 
-ngx_inline void
+/*
+** @description: This function is called to init the cache rbtree.
+** @para: ngx_rbtree_t *rbtree
+** @para: ngx_rbtree_node_t *sentinel
+** @return: void
+*/
+
+void
 yy_sec_waf_re_cache_init_rbtree(ngx_rbtree_t *rbtree,
     ngx_rbtree_node_t *sentinel) 
 {
     ngx_rbtree_init(rbtree, sentinel, ngx_str_rbtree_insert_value);
 }
 
+/*
+** @description: This function is called to set value into the cache.
+** The name is copied, the value is stored as it is.
+** @para: ngx_pool_t *pool
+** @para: ngx_str_t *name
+** @para: ngx_str_t *value
+** @para: ngx_rbtree_t *rbtree
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
 ngx_int_t
 yy_sec_waf_re_cache_set_value(ngx_pool_t *pool,
-    ngx_str_t *name, ngx_array_t *value, ngx_rbtree_t *rbtree)
+    ngx_str_t *name, ngx_str_t *value, ngx_rbtree_t *rbtree)
 {
     uint32_t         hash;
-    ngx_str_t       *val;
     re_cache_node_t *cache_node;
 
     hash = ngx_crc32_long(name->data, name->len);
@@ -33,6 +49,7 @@ yy_sec_waf_re_cache_set_value(ngx_pool_t *pool,
     cache_node = (re_cache_node_t *) ngx_str_rbtree_lookup(rbtree, name, hash);
 
     if (cache_node != NULL) {
+        cache_node->value = *value;
         return NGX_OK;
     }
 
@@ -42,29 +59,28 @@ yy_sec_waf_re_cache_set_value(ngx_pool_t *pool,
         return NGX_ERROR;
     }
 
-    val = ngx_palloc(pool, sizeof(ngx_str_t));
-
-    if (value == NULL) {
-        return NGX_ERROR;
-    }
-
-    val->len = value->len;
-    val->data = ngx_pstrdup(pool, value);
-    if (val->data == NULL) {
+    cache_node->sn.str.len = name->len;
+    cache_node->sn.str.data = ngx_pstrdup(pool, name);
+    if (cache_node->sn.str.data == NULL) {
         return NGX_ERROR;
     }
 
     cache_node->sn.node.key = hash;
-    cache_node->sn.str.len = name->len;
-    cache_node->sn.str.data = name->data;
-    cache_node->value = value;
+    cache_node->value = *value;
 
     ngx_rbtree_insert(rbtree, &cache_node->sn.node);
 
     return NGX_OK;
 }
 
-ngx_inline ngx_array_t *
+/*
+** @description: This function is called to get value from the cache.
+** @para: ngx_rbtree_t *rbtree
+** @para: ngx_str_t *name
+** @return: ngx_str_t * or NULL if not cached.
+*/
+
+ngx_str_t *
 yy_sec_waf_re_cache_get_value(ngx_rbtree_t *rbtree, ngx_str_t *name)
 {
     uint32_t         hash;
@@ -75,9 +91,8 @@ yy_sec_waf_re_cache_get_value(ngx_rbtree_t *rbtree, ngx_str_t *name)
     cache_node = (re_cache_node_t *) ngx_str_rbtree_lookup(rbtree, name, hash);
 
     if (cache_node != NULL) {
-        return cache_node->value;
+        return &cache_node->value;
     }
 
     return NULL;
 }
-
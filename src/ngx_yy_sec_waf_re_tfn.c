@@ -10,28 +10,240 @@
 
 /*
 ** @description: This function is called to excute urldecode tfs.
-** @para: ngx_http_variable_value_t *v
-** @return: RULE_MATCH or RULE_NO_MATCH if failed.
+** The variable itself is never written, a decoded copy is made
+** only when there is something to decode.
+** @para: ngx_http_request_t *r
+** @para: ngx_str_t *str
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+yy_sec_waf_re_tfns_urldecode(ngx_http_request_t *r, ngx_str_t *str)
+{
+    ngx_str_t decoded;
+
+    if (str == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_yy_sec_waf_scan_escape(str->data, str->data + str->len)
+        == str->data + str->len)
+    {
+        return NGX_OK;
+    }
+
+    decoded.len = str->len;
+    decoded.data = ngx_pnalloc(r->pool, str->len);
+    if (decoded.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(decoded.data, str->data, str->len);
+
+    ngx_yy_sec_waf_unescape(&decoded);
+
+    *str = decoded;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to parse 4 hex digits of %uXXXX.
+** @para: u_char *p
+** @return: the code unit or -1 if failed.
+*/
+
+static ngx_int_t
+yy_sec_waf_re_tfns_hex4(u_char *p)
+{
+    u_char     c;
+    ngx_int_t  n;
+    ngx_uint_t i;
+
+    for (n = 0, i = 0; i < 4; i++) {
+        c = p[i];
+
+        if (c >= '0' && c <= '9') {
+            n = (n << 4) + c - '0';
+            continue;
+        }
+
+        c = (u_char) (c | 0x20);
+
+        if (c >= 'a' && c <= 'f') {
+            n = (n << 4) + c - 'a' + 10;
+            continue;
+        }
+
+        return -1;
+    }
+
+    return n;
+}
+
+/*
+** @description: This function is called to write a code point
+** in its shortest utf-8 form. Fullwidth ascii forms (U+FF01-U+FF5E),
+** which IIS maps to ascii, are folded as well.
+** @para: u_char *d
+** @para: uint32_t cp
+** @return: u_char * past the written bytes.
+*/
+
+static u_char *
+yy_sec_waf_re_tfns_put_code_point(u_char *d, uint32_t cp)
+{
+    if (cp >= 0xff01 && cp <= 0xff5e) {
+        cp -= 0xfee0;
+    }
+
+    if (cp < 0x80) {
+        *d++ = (u_char) cp;
+
+    } else if (cp < 0x800) {
+        *d++ = (u_char) (0xc0 | (cp >> 6));
+        *d++ = (u_char) (0x80 | (cp & 0x3f));
+
+    } else if (cp < 0x10000) {
+        *d++ = (u_char) (0xe0 | (cp >> 12));
+        *d++ = (u_char) (0x80 | ((cp >> 6) & 0x3f));
+        *d++ = (u_char) (0x80 | (cp & 0x3f));
+
+    } else {
+        *d++ = (u_char) (0xf0 | (cp >> 18));
+        *d++ = (u_char) (0x80 | ((cp >> 12) & 0x3f));
+        *d++ = (u_char) (0x80 | ((cp >> 6) & 0x3f));
+        *d++ = (u_char) (0x80 | (cp & 0x3f));
+    }
+
+    return d;
+}
+
+/*
+** @description: This function is called to excute normalizeunicode tfs.
+** - %uXXXX escapes (and %uD8XX%uDCXX pairs) are decoded to utf-8,
+** - overlong utf-8 sequences are rewritten in their shortest form,
+** - fullwidth ascii forms are folded to ascii,
+** - invalid bytes are kept as they are.
+** Runs of plain ascii are skipped by ngx_yy_sec_waf_scan_unicode,
+** so pure ascii values are returned without any copy.
+** The result is never longer than the input.
+** @para: ngx_http_request_t *r
+** @para: ngx_str_t *str
+** @return: NGX_OK or NGX_ERROR if failed.
 */
 
 static ngx_int_t
-yy_sec_waf_re_tfns_urldecode(ngx_http_variable_value_t *v)
+yy_sec_waf_re_tfns_normalize_unicode(ngx_http_request_t *r, ngx_str_t *str)
 {
-    if (v == NULL) {
+    u_char     *s, *d, *p, *last, *start;
+    ngx_int_t   cp, lo;
+    ngx_uint_t  i, n;
+
+    if (str == NULL) {
+        return NGX_ERROR;
+    }
+
+    last = str->data + str->len;
+
+    s = ngx_yy_sec_waf_scan_unicode(str->data, last);
+
+    if (s == last) {
+        return NGX_OK;
+    }
+
+    start = ngx_pnalloc(r->pool, str->len);
+    if (start == NULL) {
         return NGX_ERROR;
     }
 
-    ngx_str_t str;
-    str.data = v->data;
-    str.len = v->len;
+    d = ngx_cpymem(start, str->data, s - str->data);
+
+    while (s < last) {
+
+        if (*s == '%') {
+            if (last - s >= 6 && (s[1] | 0x20) == 'u'
+                && (cp = yy_sec_waf_re_tfns_hex4(s + 2)) >= 0)
+            {
+                s += 6;
+
+                if (cp >= 0xd800 && cp <= 0xdbff
+                    && last - s >= 6 && s[0] == '%' && (s[1] | 0x20) == 'u'
+                    && (lo = yy_sec_waf_re_tfns_hex4(s + 2)) >= 0xdc00
+                    && lo <= 0xdfff)
+                {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                    s += 6;
+                }
+
+                d = yy_sec_waf_re_tfns_put_code_point(d, (uint32_t) cp);
+
+            } else {
+                *d++ = *s++;
+            }
+
+        } else if (*s >= 0x80) {
+
+            if (*s >= 0xc0 && *s <= 0xdf) {
+                n = 1;
+                cp = *s & 0x1f;
+
+            } else if (*s >= 0xe0 && *s <= 0xef) {
+                n = 2;
+                cp = *s & 0x0f;
+
+            } else if (*s >= 0xf0 && *s <= 0xf7) {
+                n = 3;
+                cp = *s & 0x07;
+
+            } else {
+                n = 0;
+                cp = 0;
+            }
+
+            if (n == 0 || (ngx_uint_t) (last - s) <= n) {
+                *d++ = *s++;
+                goto ascii;
+            }
+
+            for (i = 1; i <= n; i++) {
+                if ((s[i] & 0xc0) != 0x80) {
+                    break;
+                }
+
+                cp = (cp << 6) | (s[i] & 0x3f);
+            }
+
+            if (i <= n || cp > 0x10ffff) {
+                *d++ = *s++;
+                goto ascii;
+            }
+
+            /* overlong forms come out in their shortest encoding here */
+            d = yy_sec_waf_re_tfns_put_code_point(d, (uint32_t) cp);
+            s += n + 1;
+
+        } else {
+            *d++ = *s++;
+        }
+
+    ascii:
+
+        p = ngx_yy_sec_waf_scan_unicode(s, last);
+        d = ngx_cpymem(d, s, p - s);
+        s = p;
+    }
 
-    ngx_yy_sec_waf_unescape(&str);
+    str->data = start;
+    str->len = d - start;
 
     return NGX_OK;
 }
 
 static re_tfns_metadata tfns_metadata[] = {
     { ngx_string("urldecode"), yy_sec_waf_re_tfns_urldecode },
+    { ngx_string("utf8tounicode"), yy_sec_waf_re_tfns_normalize_unicode },
+    { ngx_string("normalizeunicode"), yy_sec_waf_re_tfns_normalize_unicode },
     { ngx_null_string, NULL }
 };
 
@@ -9,7 +9,7 @@
 #include "ngx_yy_sec_waf_re.h"
 
 /*
-** @description: This function is called to get args.
+** @description: This function is called to get post args count.
 ** @para: ngx_http_request_t *r
 ** @para: ngx_http_variable_value_t *v
 ** @para: uintptr_t data
@@ -17,11 +17,11 @@
 */
 
 static ngx_int_t
-yy_sec_waf_get_args(ngx_http_request_t *r,
+yy_sec_waf_get_post_args_count(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
 {
+    u_char                    *p;
     ngx_http_request_ctx_t    *ctx;
-    ngx_str_t                  p;
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_yy_sec_waf_module);
 
@@ -30,39 +30,25 @@ yy_sec_waf_get_args(ngx_http_request_t *r,
         return NGX_OK;
     }
 
-    if (ctx->args.len == 0 && ctx->post_args.len == 0){
+    if (ctx->post_args_count == 0) {
         v->not_found = 1;
         return NGX_OK;
     }
 
-    v->data = ctx->args.data;
-    v->len = ctx->args.len;
-
-    if (ctx->post_args.len) {
-        p.len = ctx->args.len+ctx->post_args.len+1;
-        p.data = ngx_palloc(r->pool, p.len);
-        if (p.data == NULL) {
-            return NGX_ERROR;
-        }
-
-        v->data = p.data;
-        v->len = p.len;
-
-        p.data = ngx_cpymem(p.data, ctx->args.data, ctx->args.len);
-        p.data = ngx_cpymem(p.data, ",", 1);
-        ngx_memcpy(p.data, ctx->post_args.data, ctx->post_args.len);
-    }
+    p = ngx_yy_sec_waf_uitoa(r->pool, ctx->post_args_count);
 
+    v->len = ngx_strlen(p);
     v->valid = 1;
     v->no_cacheable = 0;
     v->escape = 0;
     v->not_found = 0;
+    v->data = p;
 
     return NGX_OK;
 }
 
 /*
-** @description: This function is called to get post args count.
+** @description: This function is called to get process body error.
 ** @para: ngx_http_request_t *r
 ** @para: ngx_http_variable_value_t *v
 ** @para: uintptr_t data
@@ -70,10 +56,9 @@ yy_sec_waf_get_args(ngx_http_request_t *r,
 */
 
 static ngx_int_t
-yy_sec_waf_get_post_args_count(ngx_http_request_t *r,
+yy_sec_waf_get_process_body_error(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
 {
-    u_char                    *p;
     ngx_http_request_ctx_t    *ctx;
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_yy_sec_waf_module);
@@ -83,25 +68,21 @@ yy_sec_waf_get_post_args_count(ngx_http_request_t *r,
         return NGX_OK;
     }
 
-    if (ctx->post_args_count == 0) {
+    /* bad hex encoding in the query string is reported here too */
+    ngx_http_yy_sec_waf_process_args(r, ctx);
+
+    if (ctx->process_body_error == 1) {
+        *v = ngx_http_variable_true_value;
+    } else {
         v->not_found = 1;
-        return NGX_OK;
     }
 
-    p = ngx_yy_sec_waf_uitoa(r->pool, ctx->post_args_count);
-
-    v->len = ngx_strlen(p);
-    v->valid = 1;
-    v->no_cacheable = 0;
-    v->escape = 0;
-    v->not_found = 0;
-    v->data = p;
-
     return NGX_OK;
 }
 
 /*
-** @description: This function is called to get process body error.
+** @description: This function is called to get whether the body was
+** inspected up to its inspection window only.
 ** @para: ngx_http_request_t *r
 ** @para: ngx_http_variable_value_t *v
 ** @para: uintptr_t data
@@ -109,19 +90,14 @@ yy_sec_waf_get_post_args_count(ngx_http_request_t *r,
 */
 
 static ngx_int_t
-yy_sec_waf_get_process_body_error(ngx_http_request_t *r,
+yy_sec_waf_get_body_truncated(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
 {
     ngx_http_request_ctx_t    *ctx;
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_yy_sec_waf_module);
 
-    if (ctx == NULL) {
-        v->not_found = 1;
-        return NGX_OK;
-    }
-
-    if (ctx->process_body_error == 1) {
+    if (ctx != NULL && ctx->body_truncated) {
         *v = ngx_http_variable_true_value;
     } else {
         v->not_found = 1;
@@ -131,7 +107,8 @@ yy_sec_waf_get_process_body_error(ngx_http_request_t *r,
 }
 
 /*
-** @description: This function is called to get multipart name.
+** @description: This function is called to get the most argument names
+** in one bucket of the hash tables of php, java or python.
 ** @para: ngx_http_request_t *r
 ** @para: ngx_http_variable_value_t *v
 ** @para: uintptr_t data
@@ -139,11 +116,9 @@ yy_sec_waf_get_process_body_error(ngx_http_request_t *r,
 */
 
 static ngx_int_t
-yy_sec_waf_get_multipart_name(ngx_http_request_t *r,
+yy_sec_waf_get_args_hash_collisions(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
 {
-    ngx_uint_t                 i;
-    ngx_str_t                 *var;
     u_char                    *p;
     ngx_http_request_ctx_t    *ctx;
 
@@ -154,25 +129,16 @@ yy_sec_waf_get_multipart_name(ngx_http_request_t *r,
         return NGX_OK;
     }
 
-    var = ctx->multipart_name.elts;
+    ngx_http_yy_sec_waf_process_args(r, ctx);
 
-    for (i = 0; i < ctx->multipart_name.nelts; i++) {
-        v->len += var[i].len;
-    }
-
-    if (v->len == 0) {
+    if (ctx->args_hash_collisions == 0) {
         v->not_found = 1;
         return NGX_OK;
     }
 
-    v->data = ngx_palloc(r->pool, v->len);
-
-    p = v->data;
-
-    for (i = 0; i < ctx->multipart_name.nelts; i++) {
-        v->data = ngx_cpymem(v->data, var[i].data, var[i].len);
-    }
+    p = ngx_yy_sec_waf_uitoa(r->pool, ctx->args_hash_collisions);
 
+    v->len = ngx_strlen(p);
     v->valid = 1;
     v->no_cacheable = 0;
     v->escape = 0;
@@ -183,19 +149,17 @@ yy_sec_waf_get_multipart_name(ngx_http_request_t *r,
 }
 
 /*
-** @description: This function is called to get multipart filename.
+** @description: This function is called to get connection per ip.
 ** @para: ngx_http_request_t *r
 ** @para: ngx_http_variable_value_t *v
 ** @para: uintptr_t data
-** @return: NGX_OK or NGX_ERROR if failed.
+** @return: static ngx_int_t.
 */
 
 static ngx_int_t
-yy_sec_waf_get_multipart_filename(ngx_http_request_t *r,
+yy_sec_waf_get_conn_per_ip(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
 {
-    ngx_uint_t                 i;
-    ngx_str_t                 *var;
     u_char                    *p;
     ngx_http_request_ctx_t    *ctx;
 
@@ -206,25 +170,14 @@ yy_sec_waf_get_multipart_filename(ngx_http_request_t *r,
         return NGX_OK;
     }
 
-    var = ctx->multipart_filename.elts;
-
-    for (i = 0; i < ctx->multipart_filename.nelts; i++) {
-        v->len += var[i].len;
-    }
-
-    if (v->len == 0) {
+    if (ctx->conn_per_ip == 0) {
         v->not_found = 1;
         return NGX_OK;
     }
 
-    v->data = ngx_palloc(r->pool, v->len);
-
-    p = v->data;
-
-    for (i = 0; i < ctx->multipart_filename.nelts; i++) {
-        v->data = ngx_cpymem(v->data, var[i].data, var[i].len);
-    }
+    p = ngx_yy_sec_waf_uitoa(r->pool, ctx->conn_per_ip);
 
+    v->len = ngx_strlen(p);
     v->valid = 1;
     v->no_cacheable = 0;
     v->escape = 0;
@@ -235,18 +188,21 @@ yy_sec_waf_get_multipart_filename(ngx_http_request_t *r,
 }
 
 /*
-** @description: This function is called to get connection per ip.
+** @description: This function is called to get the normalized request path.
+** The raw path is decoded and its dot segments and duplicate slashes are
+** resolved in one pass, the first time a rule asks for it.
 ** @para: ngx_http_request_t *r
 ** @para: ngx_http_variable_value_t *v
 ** @para: uintptr_t data
-** @return: static ngx_int_t.
+** @return: NGX_OK or NGX_ERROR if failed.
 */
 
 static ngx_int_t
-yy_sec_waf_get_conn_per_ip(ngx_http_request_t *r,
+yy_sec_waf_get_request_path_normalized(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data)
 {
-    u_char                    *p;
+    u_char                    *last;
+    ngx_str_t                  path;
     ngx_http_request_ctx_t    *ctx;
 
     ctx = ngx_http_get_module_ctx(r, ngx_http_yy_sec_waf_module);
@@ -256,50 +212,400 @@ yy_sec_waf_get_conn_per_ip(ngx_http_request_t *r,
         return NGX_OK;
     }
 
-    if (ctx->conn_per_ip == 0) {
+    if (!ctx->path_normalized_done) {
+        path = r->unparsed_uri;
+
+        last = ngx_strlchr(path.data, path.data + path.len, '?');
+        if (last != NULL) {
+            path.len = last - path.data;
+        }
+
+        ctx->path_normalized.data = ngx_pnalloc(r->pool, path.len);
+        if (ctx->path_normalized.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        last = ngx_yy_sec_waf_normalize_path(ctx->path_normalized.data,
+                                             path.data, path.len);
+
+        ctx->path_normalized.len = last - ctx->path_normalized.data;
+        ctx->path_normalized_done = 1;
+    }
+
+    if (ctx->path_normalized.len == 0) {
         v->not_found = 1;
         return NGX_OK;
     }
 
-    p = ngx_yy_sec_waf_uitoa(r->pool, ctx->conn_per_ip);
-
-    v->len = ngx_strlen(p);
+    v->data = ctx->path_normalized.data;
+    v->len = ctx->path_normalized.len;
     v->valid = 1;
     v->no_cacheable = 0;
     v->escape = 0;
     v->not_found = 0;
-    v->data = p;
 
     return NGX_OK;
 }
 
+/*
+** data holds the VAR_NEED_* flags of the variable. The body variables
+** change as the body is parsed, chunk by chunk when it is streamed, so
+** they are evaluated anew each time a rule reads them.
+*/
 static ngx_http_variable_t var_metadata[] = {
 
-    { ngx_string("ARGS"), NULL, yy_sec_waf_get_args,
-      0, 0, 0 },
-
-    { ngx_string("ARGS_POST"), NULL, yy_sec_waf_get_args,
-      0, 0, 0 },
-
     { ngx_string("POST_ARGS_COUNT"), NULL, yy_sec_waf_get_post_args_count,
-      0, 0, 0 },
+      VAR_NEED_BODY, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
     { ngx_string("PROCESS_BODY_ERROR"), NULL, yy_sec_waf_get_process_body_error,
-      0, 0, 0 },
+      VAR_NEED_ARGS|VAR_NEED_BODY, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
-    { ngx_string("MULTIPART_NAME"), NULL, yy_sec_waf_get_multipart_name,
-      0, 0, 0 },
+    { ngx_string("BODY_TRUNCATED"), NULL, yy_sec_waf_get_body_truncated,
+      VAR_NEED_BODY, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
-    { ngx_string("MULTIPART_FILENAME"), NULL, yy_sec_waf_get_multipart_filename,
-      0, 0, 0 },
+    { ngx_string("ARGS_HASH_COLLISIONS"), NULL,
+      yy_sec_waf_get_args_hash_collisions,
+      VAR_NEED_ARGS|VAR_NEED_ARGS_HASH|VAR_NEED_BODY, NGX_HTTP_VAR_NOCACHEABLE, 0 },
 
     { ngx_string("CONN_PER_IP"), NULL, yy_sec_waf_get_conn_per_ip,
       0, 0, 0 },
 
+    { ngx_string("REQUEST_PATH_NORMALIZED"), NULL,
+      yy_sec_waf_get_request_path_normalized, 0, 0, 0 },
+
     { ngx_null_string, NULL, NULL,
       0, 0, 0 }
 };
 
+/*
+** @description: This function is called to get the args of the query
+** string and the body.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: ngx_http_yy_sec_waf_collection_t *
+*/
+
+static ngx_http_yy_sec_waf_collection_t *
+yy_sec_waf_get_args(ngx_http_request_t *r, ngx_http_request_ctx_t *ctx)
+{
+    ngx_http_yy_sec_waf_process_args(r, ctx);
+
+    return &ctx->args;
+}
+
+/*
+** @description: This function is called to get the args of the query string.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: ngx_http_yy_sec_waf_collection_t *
+*/
+
+static ngx_http_yy_sec_waf_collection_t *
+yy_sec_waf_get_args_get(ngx_http_request_t *r, ngx_http_request_ctx_t *ctx)
+{
+    ngx_http_yy_sec_waf_process_args(r, ctx);
+
+    return &ctx->args_get;
+}
+
+/*
+** @description: This function is called to get the args of the body.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: ngx_http_yy_sec_waf_collection_t *
+*/
+
+static ngx_http_yy_sec_waf_collection_t *
+yy_sec_waf_get_args_post(ngx_http_request_t *r, ngx_http_request_ctx_t *ctx)
+{
+    return &ctx->args_post;
+}
+
+/*
+** @description: This function is called to get the parts of a multipart
+** body, the part names are the keys and the filenames the values.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: ngx_http_yy_sec_waf_collection_t *
+*/
+
+static ngx_http_yy_sec_waf_collection_t *
+yy_sec_waf_get_multipart(ngx_http_request_t *r, ngx_http_request_ctx_t *ctx)
+{
+    return &ctx->multipart;
+}
+
+/*
+** @description: This function is called to get the headers of the parts
+** of a multipart body.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: ngx_http_yy_sec_waf_collection_t *
+*/
+
+static ngx_http_yy_sec_waf_collection_t *
+yy_sec_waf_get_multipart_part_headers(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx)
+{
+    return &ctx->multipart_part_headers;
+}
+
+/*
+** @description: This function is called to get the bodies of the parts
+** of a multipart body, the part names are the keys.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: ngx_http_yy_sec_waf_collection_t *
+*/
+
+static ngx_http_yy_sec_waf_collection_t *
+yy_sec_waf_get_multipart_part_body(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx)
+{
+    return &ctx->multipart_part_body;
+}
+
+/*
+** @description: This function is called to get the types of the file
+** parts of a multipart body, by their first bytes.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: ngx_http_yy_sec_waf_collection_t *
+*/
+
+static ngx_http_yy_sec_waf_collection_t *
+yy_sec_waf_get_multipart_file_type(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx)
+{
+    return &ctx->multipart_file_type;
+}
+
+/*
+** @description: This function is called to parse a Cookie header into
+** ctx->cookies. The names and the values refer to the header.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @para: ngx_str_t *header
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+yy_sec_waf_parse_cookie(ngx_http_request_t *r, ngx_http_request_ctx_t *ctx,
+    ngx_str_t *header)
+{
+    u_char    *p, *last, *end, *eq;
+    ngx_str_t  name, value;
+
+    p = header->data;
+    last = header->data + header->len;
+
+    while (p < last) {
+        end = ngx_strlchr(p, last, ';');
+        if (end == NULL) {
+            end = last;
+        }
+
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+
+        eq = ngx_strlchr(p, end, '=');
+
+        name.data = p;
+        name.len = (eq? eq: end) - p;
+
+        while (name.len && (name.data[name.len - 1] == ' '
+                            || name.data[name.len - 1] == '\t'))
+        {
+            name.len--;
+        }
+
+        value.data = eq? eq + 1: end;
+
+        while (value.data < end && (*value.data == ' ' || *value.data == '\t')) {
+            value.data++;
+        }
+
+        value.len = end - value.data;
+
+        while (value.len && (value.data[value.len - 1] == ' '
+                             || value.data[value.len - 1] == '\t'))
+        {
+            value.len--;
+        }
+
+        if (name.len
+            && ngx_yy_sec_waf_collection_push(r->pool, &ctx->cookies,
+                                              &name, &value) == NULL)
+        {
+            return NGX_ERROR;
+        }
+
+        p = end + 1;
+    }
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to get the cookies of the request.
+** The Cookie headers are parsed once, the first time a rule asks for them.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: ngx_http_yy_sec_waf_collection_t *
+*/
+
+static ngx_http_yy_sec_waf_collection_t *
+yy_sec_waf_get_cookies(ngx_http_request_t *r, ngx_http_request_ctx_t *ctx)
+{
+    ngx_table_elt_t  *h;
+#if (nginx_version < 1023000)
+    ngx_uint_t        i;
+    ngx_table_elt_t **cookies;
+#endif
+
+    if (ctx->cookies_done) {
+        return &ctx->cookies;
+    }
+
+    ctx->cookies_done = 1;
+
+#if (nginx_version >= 1023000)
+    for (h = r->headers_in.cookie; h; h = h->next) {
+        if (yy_sec_waf_parse_cookie(r, ctx, &h->value) != NGX_OK) {
+            break;
+        }
+    }
+#else
+    cookies = r->headers_in.cookies.elts;
+
+    for (i = 0; i < r->headers_in.cookies.nelts; i++) {
+        h = cookies[i];
+
+        if (yy_sec_waf_parse_cookie(r, ctx, &h->value) != NGX_OK) {
+            break;
+        }
+    }
+#endif
+
+    return &ctx->cookies;
+}
+
+/*
+** @description: This function is called to get the headers of the request.
+** The header list is walked once, the first time a rule asks for them,
+** then a header is looked up through the name index of the collection.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: ngx_http_yy_sec_waf_collection_t *
+*/
+
+static ngx_http_yy_sec_waf_collection_t *
+yy_sec_waf_get_headers(ngx_http_request_t *r, ngx_http_request_ctx_t *ctx)
+{
+    ngx_uint_t        i;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *h;
+
+    if (ctx->headers_done) {
+        return &ctx->headers;
+    }
+
+    ctx->headers_done = 1;
+
+    part = &r->headers_in.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].hash == 0) {
+            continue;
+        }
+
+        if (ngx_yy_sec_waf_collection_push(r->pool, &ctx->headers,
+                                           &h[i].key, &h[i].value) == NULL)
+        {
+            break;
+        }
+    }
+
+    return &ctx->headers;
+}
+
+/*
+** @description: This function is called to get the response buffer being
+** sent, and the bytes across it and the former buffer.
+** @para: ngx_http_request_t *r
+** @para: ngx_http_request_ctx_t *ctx
+** @return: ngx_http_yy_sec_waf_collection_t *
+*/
+
+static ngx_http_yy_sec_waf_collection_t *
+yy_sec_waf_get_response_body(ngx_http_request_t *r,
+    ngx_http_request_ctx_t *ctx)
+{
+    return &ctx->response_body;
+}
+
+static re_collection_metadata collection_metadata[] = {
+    { ngx_string("ARGS"), yy_sec_waf_get_args,
+      COLLECTION_VALUES, VAR_NEED_ARGS|VAR_NEED_BODY },
+
+    { ngx_string("ARGS_GET"), yy_sec_waf_get_args_get,
+      COLLECTION_VALUES, VAR_NEED_ARGS },
+
+    { ngx_string("ARGS_POST"), yy_sec_waf_get_args_post,
+      COLLECTION_VALUES, VAR_NEED_BODY },
+
+    { ngx_string("ARGS_NAMES"), yy_sec_waf_get_args,
+      COLLECTION_NAMES, VAR_NEED_ARGS|VAR_NEED_BODY },
+
+    { ngx_string("ARGS_LEN"), yy_sec_waf_get_args,
+      COLLECTION_LENGTH, VAR_NEED_ARGS|VAR_NEED_BODY },
+
+    { ngx_string("MULTIPART_NAME"), yy_sec_waf_get_multipart,
+      COLLECTION_NAMES, VAR_NEED_BODY },
+
+    { ngx_string("MULTIPART_FILENAME"), yy_sec_waf_get_multipart,
+      COLLECTION_VALUES, VAR_NEED_BODY },
+
+    { ngx_string("MULTIPART_PART_HEADERS"), yy_sec_waf_get_multipart_part_headers,
+      COLLECTION_VALUES, VAR_NEED_MULTIPART_PARTS|VAR_NEED_BODY },
+
+    { ngx_string("MULTIPART_PART_BODY"), yy_sec_waf_get_multipart_part_body,
+      COLLECTION_VALUES, VAR_NEED_MULTIPART_PARTS|VAR_NEED_BODY },
+
+    { ngx_string("REQUEST_COOKIES"), yy_sec_waf_get_cookies,
+      COLLECTION_VALUES, 0 },
+
+    { ngx_string("REQUEST_COOKIES_NAMES"), yy_sec_waf_get_cookies,
+      COLLECTION_NAMES, 0 },
+
+    { ngx_string("REQUEST_HEADERS"), yy_sec_waf_get_headers,
+      COLLECTION_VALUES, 0 },
+
+    { ngx_string("REQUEST_HEADERS_NAMES"), yy_sec_waf_get_headers,
+      COLLECTION_NAMES, 0 },
+
+    { ngx_string("MULTIPART_FILE_TYPE"), yy_sec_waf_get_multipart_file_type,
+      COLLECTION_VALUES, VAR_NEED_MULTIPART_FILE_TYPE|VAR_NEED_BODY },
+
+    { ngx_string("RESPONSE_BODY"), yy_sec_waf_get_response_body,
+      COLLECTION_VALUES, VAR_NEED_RESPONSE_BODY },
+
+    { ngx_null_string, NULL, 0, 0 }
+};
+
 ngx_int_t
 ngx_http_yy_sec_waf_add_variables(ngx_conf_t *cf)
 {
@@ -318,4 +624,96 @@ ngx_http_yy_sec_waf_add_variables(ngx_conf_t *cf)
     return NGX_OK;
 }
 
+/*
+** @description: This function is called to init collections.
+** @para: ngx_conf_t *cf
+** @para: ngx_hash_t *collections_in_hash
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+ngx_int_t
+ngx_http_yy_sec_waf_init_collections_in_hash(ngx_conf_t *cf,
+    ngx_hash_t *collections_in_hash)
+{
+    ngx_array_t             collections;
+    ngx_hash_key_t         *hk;
+    ngx_hash_init_t         hash;
+    re_collection_metadata *metadata;
+
+    if (ngx_array_init(&collections, cf->temp_pool, 32, sizeof(ngx_hash_key_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    for (metadata = collection_metadata; metadata->name.len; metadata++) {
+        hk = ngx_array_push(&collections);
+        if (hk == NULL) {
+            return NGX_ERROR;
+        }
+
+        hk->key = metadata->name;
+        hk->key_hash = ngx_hash_key_lc(metadata->name.data, metadata->name.len);
+        hk->value = metadata;
+    }
+
+    hash.hash = collections_in_hash;
+    hash.key = ngx_hash_key_lc;
+    hash.max_size = 512;
+    hash.bucket_size = ngx_align(64, ngx_cacheline_size);
+    hash.name = "collections_in_hash";
+    hash.pool = cf->pool;
+    hash.temp_pool = NULL;
+
+    if (ngx_hash_init(&hash, collections.elts, collections.nelts) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to collect the VAR_NEED_* flags
+** of the variables used by rules, so that request data no rule looks at
+** is never parsed.
+** @para: ngx_conf_t *cf
+** @para: ngx_array_t *rules
+** @return: ngx_uint_t
+*/
+
+ngx_uint_t
+ngx_http_yy_sec_waf_rules_var_flags(ngx_conf_t *cf, ngx_array_t *rules)
+{
+    ngx_uint_t                      i, j, flags;
+    ngx_http_variable_t            *v;
+    ngx_http_yy_sec_waf_rule_t     *rule;
+    ngx_http_yy_sec_waf_rule_var_t *var;
+
+    if (rules == NULL) {
+        return 0;
+    }
+
+    flags = 0;
+    rule = rules->elts;
+
+    for (i = 0; i < rules->nelts; i++) {
+        var = rule[i].vars.elts;
+
+        for (j = 0; j < rule[i].vars.nelts; j++) {
+            if (var[j].collection != NULL) {
+                flags |= ((re_collection_metadata *) var[j].collection)->need;
+                continue;
+            }
+
+            for (v = var_metadata; v->name.len != 0; v++) {
+                if (v->data
+                    && ngx_http_get_variable_index(cf, &v->name) == var[j].index)
+                {
+                    flags |= v->data;
+                }
+            }
+        }
+    }
 
+    return flags;
+}
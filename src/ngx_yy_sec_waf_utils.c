@@ -9,30 +9,178 @@
 #include "ngx_yy_sec_waf.h"
 #include <ifaddrs.h>
 
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define YY_SEC_WAF_HAVE_SSE2 1
+#endif
+
 static int
 ngx_yy_sec_waf_unescape_uri(u_char **dst, u_char **src, size_t size, ngx_uint_t type);
 
+/*
+** @description: This function is called to find the first byte which
+** the unescape routine has to look at: '%', '+' or a null byte.
+** Sixteen bytes are tested at a time when SSE2 is available.
+** @para: u_char *p
+** @para: u_char *last
+** @return: pointer to the first such byte, or last if there is none.
+*/
+
+u_char *
+ngx_yy_sec_waf_scan_escape(u_char *p, u_char *last)
+{
+#if (YY_SEC_WAF_HAVE_SSE2)
+    int      mask;
+    __m128i  chunk, percent, plus, zero;
+
+    percent = _mm_set1_epi8('%');
+    plus = _mm_set1_epi8('+');
+    zero = _mm_setzero_si128();
+
+    while (last - p >= 16) {
+        chunk = _mm_loadu_si128((const __m128i *) p);
+
+        mask = _mm_movemask_epi8(
+                   _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, percent),
+                                             _mm_cmpeq_epi8(chunk, plus)),
+                                _mm_cmpeq_epi8(chunk, zero)));
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+#endif
+
+    while (p < last) {
+        if (*p == '%' || *p == '+' || *p == '\0') {
+            return p;
+        }
+
+        p++;
+    }
+
+    return last;
+}
+
+/*
+** @description: This function is called to find the first byte which
+** may start a unicode sequence: a non-ascii byte or '%'.
+** @para: u_char *p
+** @para: u_char *last
+** @return: pointer to the first such byte, or last if there is none.
+*/
+
+u_char *
+ngx_yy_sec_waf_scan_unicode(u_char *p, u_char *last)
+{
+#if (YY_SEC_WAF_HAVE_SSE2)
+    int      mask;
+    __m128i  chunk, percent;
+
+    percent = _mm_set1_epi8('%');
+
+    while (last - p >= 16) {
+        chunk = _mm_loadu_si128((const __m128i *) p);
+
+        /* the high bit of every non-ascii byte is set already */
+        mask = _mm_movemask_epi8(_mm_or_si128(chunk,
+                                              _mm_cmpeq_epi8(chunk, percent)));
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+#endif
+
+    while (p < last) {
+        if (*p >= 0x80 || *p == '%') {
+            return p;
+        }
+
+        p++;
+    }
+
+    return last;
+}
+
+/*
+** @description: This function is called to find the first CRLF, as where
+** a multipart delimiter may start. A '\r' as the last byte is returned too,
+** since its '\n' may follow in the next buffer.
+** @para: u_char *p
+** @para: u_char *last
+** @return: pointer to the '\r', or last if there is none.
+*/
+
+u_char *
+ngx_yy_sec_waf_scan_crlf(u_char *p, u_char *last)
+{
+#if (YY_SEC_WAF_HAVE_SSE2)
+    int      mask;
+    __m128i  cr, lf;
+
+    cr = _mm_set1_epi8('\r');
+    lf = _mm_set1_epi8('\n');
+
+    while (last - p >= 17) {
+        mask = _mm_movemask_epi8(_mm_and_si128(
+                   _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), cr),
+                   _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (p + 1)), lf)));
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+#endif
+
+    while (p < last) {
+        if (*p == '\r' && (p + 1 == last || p[1] == '\n')) {
+            return p;
+        }
+
+        p++;
+    }
+
+    return last;
+}
+
 /* 
 ** @description: Unescape routine.
+** The clean prefix found by ngx_yy_sec_waf_scan_escape is left untouched,
+** only the tail starting at the first escape byte is decoded.
 ** @para: ngx_str_t *str
 ** @return: uint (nullbytes+bad)
 */
 
 int
 ngx_yy_sec_waf_unescape(ngx_str_t *str) {
-    u_char *dst, *src;
-    u_int nullbytes = 0, i;
-    
-    dst = str->data;
-    src = str->data;
-        
-    ngx_yy_sec_waf_unescape_uri(&src, &dst, str->len, 0);
+    u_char *dst, *src, *tail, *last;
+    u_int nullbytes = 0;
+
+    last = str->data + str->len;
+
+    tail = ngx_yy_sec_waf_scan_escape(str->data, last);
+
+    if (tail == last) {
+        return 0;
+    }
+
+    dst = tail;
+    src = tail;
+
+    ngx_yy_sec_waf_unescape_uri(&dst, &src, last - tail, 0);
 
-    str->len = src - str->data;
+    str->len = dst - str->data;
 
     /* tmp hack fix, avoid %00 & co (null byte) encoding :p */
-    for (i = 0; i < str->len; i++) {
-        if (str->data[i] == 0x0) {
+    for ( /* void */ ; tail < dst; tail++) {
+        if (*tail == 0x0) {
     	    nullbytes++;
     	    //str->data[i] = '0';
         }
@@ -194,6 +342,100 @@ done:
     return (bad);
 }
 
+/*
+** @description: This function is called to end a path segment in
+** ngx_yy_sec_waf_normalize_path, dropping "." and resolving "..".
+** @para: u_char *start
+** @para: u_char *d
+** @return: u_char * the new end of output.
+*/
+
+static u_char *
+ngx_yy_sec_waf_path_segment(u_char *start, u_char *d)
+{
+    u_char *seg;
+
+    for (seg = d; seg > start && seg[-1] != '/'; seg--) { /* void */ }
+
+    if (d - seg == 1 && seg[0] == '.') {
+        return seg;
+    }
+
+    if (d - seg == 2 && seg[0] == '.' && seg[1] == '.') {
+        d = seg;
+
+        if (d - 1 > start) {
+            for (d--; d > start && d[-1] != '/'; d--) { /* void */ }
+        }
+    }
+
+    return d;
+}
+
+/*
+** @description: This function is called to normalize a raw path in one pass:
+** percent escapes are decoded, '\' is taken as '/', duplicate slashes
+** are merged and "." / ".." segments are resolved, never above the root.
+** dst must have room for len bytes, it may be the same as src.
+** @para: u_char *dst
+** @para: u_char *src
+** @para: size_t len
+** @return: u_char * the end of output.
+*/
+
+u_char *
+ngx_yy_sec_waf_normalize_path(u_char *dst, u_char *src, size_t len)
+{
+    u_char  *d, *last, ch, c, decoded;
+
+    d = dst;
+    last = src + len;
+
+    while (src < last) {
+        ch = *src++;
+
+        if (ch == '%' && last - src >= 2) {
+            c = (u_char) (src[0] | 0x20);
+
+            if (src[0] >= '0' && src[0] <= '9') {
+                decoded = (u_char) (src[0] - '0');
+            } else if (c >= 'a' && c <= 'f') {
+                decoded = (u_char) (c - 'a' + 10);
+            } else {
+                goto usual;
+            }
+
+            c = (u_char) (src[1] | 0x20);
+
+            if (src[1] >= '0' && src[1] <= '9') {
+                ch = (u_char) ((decoded << 4) + src[1] - '0');
+            } else if (c >= 'a' && c <= 'f') {
+                ch = (u_char) ((decoded << 4) + c - 'a' + 10);
+            } else {
+                goto usual;
+            }
+
+            src += 2;
+        }
+
+    usual:
+
+        if (ch == '/' || ch == '\\') {
+            d = ngx_yy_sec_waf_path_segment(dst, d);
+
+            if (d > dst && d[-1] == '/') {
+                continue;
+            }
+
+            ch = '/';
+        }
+
+        *d++ = ch;
+    }
+
+    return ngx_yy_sec_waf_path_segment(dst, d);
+}
+
 /* 
 ** @description: This function is called to convert ngx_int_t into u_char.
 ** @para: ngx_pool_t *p
@@ -252,6 +494,159 @@ ngx_yy_sec_waf_uitoa(ngx_pool_t *p, ngx_uint_t n)
     return start;
 }
 
+/*
+** @description: This function is called to append a name/value pair to
+** a collection. Both are referenced, not copied.
+** @para: ngx_pool_t *pool
+** @para: ngx_http_yy_sec_waf_collection_t *c
+** @para: ngx_str_t *key
+** @para: ngx_str_t *value
+** @return: the new element or NULL if failed.
+*/
+
+ngx_http_yy_sec_waf_elt_t *
+ngx_yy_sec_waf_collection_push(ngx_pool_t *pool,
+    ngx_http_yy_sec_waf_collection_t *c, ngx_str_t *key, ngx_str_t *value)
+{
+    ngx_http_yy_sec_waf_elt_t *elt;
+
+    if (c->elts.elts == NULL
+        && ngx_array_init(&c->elts, pool, 8,
+                          sizeof(ngx_http_yy_sec_waf_elt_t)) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    elt = ngx_array_push(&c->elts);
+    if (elt == NULL) {
+        return NULL;
+    }
+
+    elt->key = *key;
+    elt->value = *value;
+    elt->hash = 0;
+    elt->next = 0;
+
+    return elt;
+}
+
+/*
+** @description: This function is called to empty a collection, keeping
+** the memory of its elements and of its buckets for the next use.
+** @para: ngx_http_yy_sec_waf_collection_t *c
+** @return: void
+*/
+
+void
+ngx_yy_sec_waf_collection_reset(ngx_http_yy_sec_waf_collection_t *c)
+{
+    c->elts.nelts = 0;
+    c->nindexed = 0;
+    c->checked = 0;
+
+    if (c->buckets) {
+        ngx_memzero(c->buckets, c->nbuckets * sizeof(ngx_uint_t));
+    }
+}
+
+/*
+** @description: This function is called to bring the name index of a
+** collection up to date. Elements pushed since the last lookup are added,
+** the buckets are rebuilt once they get more elements than buckets.
+** @para: ngx_pool_t *pool
+** @para: ngx_http_yy_sec_waf_collection_t *c
+** @return: NGX_OK or NGX_ERROR if failed.
+*/
+
+static ngx_int_t
+ngx_yy_sec_waf_collection_index(ngx_pool_t *pool,
+    ngx_http_yy_sec_waf_collection_t *c)
+{
+    ngx_uint_t                 i, n, *bucket;
+    ngx_http_yy_sec_waf_elt_t *elt;
+
+    if (c->elts.nelts > c->nbuckets) {
+        for (n = 16; n < c->elts.nelts; n <<= 1) { /* void */ }
+
+        c->buckets = ngx_pcalloc(pool, n * sizeof(ngx_uint_t));
+        if (c->buckets == NULL) {
+            c->nbuckets = 0;
+            return NGX_ERROR;
+        }
+
+        c->nbuckets = n;
+        c->nindexed = 0;
+    }
+
+    elt = c->elts.elts;
+
+    for (i = c->nindexed; i < c->elts.nelts; i++) {
+        elt[i].hash = ngx_hash_key_lc(elt[i].key.data, elt[i].key.len);
+
+        bucket = &c->buckets[elt[i].hash & (c->nbuckets - 1)];
+        elt[i].next = *bucket;
+        *bucket = i + 1;
+    }
+
+    c->nindexed = c->elts.nelts;
+
+    return NGX_OK;
+}
+
+/*
+** @description: This function is called to look up the elements of a
+** collection by name, case-insensitively. Pass NULL as prev to get the
+** first element, then the previous result to get the next one.
+** @para: ngx_pool_t *pool
+** @para: ngx_http_yy_sec_waf_collection_t *c
+** @para: ngx_str_t *key
+** @para: ngx_http_yy_sec_waf_elt_t *prev
+** @return: the element or NULL if there is no (more) element.
+*/
+
+ngx_http_yy_sec_waf_elt_t *
+ngx_yy_sec_waf_collection_find(ngx_pool_t *pool,
+    ngx_http_yy_sec_waf_collection_t *c, ngx_str_t *key,
+    ngx_http_yy_sec_waf_elt_t *prev)
+{
+    ngx_uint_t                 n, hash;
+    ngx_http_yy_sec_waf_elt_t *elt;
+
+    if (prev == NULL) {
+        if (c->elts.nelts == 0) {
+            return NULL;
+        }
+
+        if (c->nindexed < c->elts.nelts
+            && ngx_yy_sec_waf_collection_index(pool, c) != NGX_OK)
+        {
+            return NULL;
+        }
+
+        hash = ngx_hash_key_lc(key->data, key->len);
+        n = c->buckets[hash & (c->nbuckets - 1)];
+
+    } else {
+        hash = prev->hash;
+        n = prev->next;
+    }
+
+    elt = c->elts.elts;
+
+    while (n) {
+        if (elt[n - 1].hash == hash
+            && elt[n - 1].key.len == key->len
+            && ngx_strncasecmp(elt[n - 1].key.data, key->data, key->len) == 0)
+        {
+            return &elt[n - 1];
+        }
+
+        n = elt[n - 1].next;
+    }
+
+    return NULL;
+}
+
 /* 
 ** @description: This function is called to get local addr.
 ** @para: ngx_connection_t *c
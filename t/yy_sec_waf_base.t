@@ -5,7 +5,7 @@ use Test::Nginx::Socket;
 
 repeat_each(3);
 
-plan tests => repeat_each(1) * blocks();
+plan tests => repeat_each(1) * (blocks() + 2);
 no_root_location();
 no_long_string();
 $ENV{TEST_NGINX_SERVROOT} = server_root();
@@ -110,3 +110,519 @@ use URI::Escape;
 "POST /
 foo1=%3Cscript%3E&foo2=bar2"
 --- error_code: 412
+
+=== TEST 10: an escape after a long clean prefix of the query string
+--- config
+location / {
+    basic_rule ARGS:q str:<script> phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+GET /?q=abcdefghijklmnopqrstuvwxyz0123456789%3Cscript%3E
+--- error_code: 412
+
+=== TEST 11: tfn, normalizeunicode
+--- config
+location / {
+    basic_rule ARGS str:<script t:normalizeunicode phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+GET /?a=%25u003cscript%25u003ealert(1)
+--- error_code: 412
+
+=== TEST 12: REQUEST_PATH_NORMALIZED, dot segments
+--- config
+location / {
+    basic_rule REQUEST_PATH_NORMALIZED str:/etc/passwd phase:1 id:1101 msg:traversal gids:LFI lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+GET /static/%2e%2e//.%2F..\etc/./passwd
+--- error_code: 412
+
+=== TEST 13: the query string is parsed on first use by a header rule
+--- config
+location / {
+    basic_rule REQUEST_PATH_NORMALIZED str:nothing phase:1 id:1000 msg:test gids:XSS lev:LOG|BLOCK;
+    basic_rule ARGS str:script phase:1 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+GET /?a=1&b=<script>
+--- error_code: 412
+
+=== TEST 14: ARGS:key, other args are not checked
+--- config
+location / {
+    basic_rule ARGS:id str:script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+GET /?q=<script>&id=1
+--- error_code: 200
+
+=== TEST 15: ARGS:key
+--- config
+location / {
+    basic_rule ARGS:id str:script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+GET /?q=1&ID=%3Cscript%3E
+--- error_code: 412
+
+=== TEST 16: ARGS_NAMES and ARGS_LEN
+--- config
+location / {
+    basic_rule ARGS_NAMES str:script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    basic_rule ARGS_LEN:id gt:8 phase:2 id:1002 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+GET /?id=123456789
+--- error_code: 412
+
+=== TEST 17: a missing first target does not hide the next one
+--- config
+location / {
+    basic_rule ARGS:id|ARGS:q str:<script> phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+GET /?q=<script>
+--- error_code: 412
+
+=== TEST 18: body_streaming, post
+--- config
+location / {
+    body_streaming on;
+    basic_rule ARGS regex:script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- more_headers
+Content-Type: application/x-www-form-urlencoded
+--- request eval
+use URI::Escape;
+"POST /
+foo1=bar1&foo2=%3Cscript%3E"
+--- error_code: 412
+--- skip_nginx: 1: < 1.8.0
+
+=== TEST 19: body_streaming, a body rejected before it is all read
+--- config
+location / {
+    client_body_timeout 1s;
+    body_streaming on;
+    basic_rule ARGS regex:script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- raw_request eval
+"POST / HTTP/1.0\r
+Host: localhost\r
+Content-Type: application/x-www-form-urlencoded\r
+Content-Length: 1024\r
+\r
+foo1=bar1&foo2=%3Cscript%3E&"
+--- error_code: 412
+--- timeout: 5
+--- skip_nginx: 1: < 1.8.0
+
+=== TEST 20: an argument parsed in place leaves the next one intact
+--- config
+location / {
+    basic_rule ARGS:foo2 regex:^bar2$ phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- more_headers
+Content-Type: application/x-www-form-urlencoded
+--- request eval
+"POST /
+foo1=%3Cscript%3E+x&foo2=bar2"
+--- error_code: 412
+
+=== TEST 21: post body in temp file
+--- config
+location / {
+    client_body_buffer_size 1k;
+    basic_rule ARGS regex:script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- more_headers
+Content-Type: application/x-www-form-urlencoded
+--- request eval
+"POST /
+pad=" . ("a" x 4096) . "&foo2=%3Cscript%3E"
+--- error_code: 412
+
+=== TEST 22: json post, ARGS:key path
+--- config
+location / {
+    basic_rule ARGS:user.name str:script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- more_headers
+Content-Type: application/json
+--- request eval
+"POST /
+{\"user\": {\"id\": 1, \"name\": \"\\u003cscript\\u003e\"}}"
+--- error_code: 412
+
+=== TEST 23: json post, malformed
+--- config
+location / {
+    basic_rule PROCESS_BODY_ERROR eq:1 phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- more_headers
+Content-Type: application/json
+--- request eval
+"POST /
+{\"user\": {\"id\": 1,}}"
+--- error_code: 412
+
+=== TEST 24: xml post
+--- config
+location / {
+    basic_rule ARGS:login.user str:script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- more_headers
+Content-Type: text/xml; charset=utf-8
+--- request eval
+"POST /
+<?xml version=\"1.0\"?><login><user>&lt;script&gt;</user></login>"
+--- error_code: 412
+
+=== TEST 25: xml post, DTD
+--- config
+location / {
+    basic_rule PROCESS_BODY_ERROR eq:1 phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- more_headers
+Content-Type: application/xml
+--- request eval
+"POST /
+<!DOCTYPE lolz [<!ENTITY lol \"lol\">]><lolz>&lol;</lolz>"
+--- error_code: 412
+
+=== TEST 26: xml post, a UTF-8 byte order mark before the prolog
+--- config
+location / {
+    basic_rule PROCESS_BODY_ERROR eq:1 phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- more_headers
+Content-Type: application/soap+xml; charset=utf-8
+--- request eval
+"POST /
+\xef\xbb\xbf<?xml version=\"1.0\"?><login><user>foo</user></login>"
+--- error_code: 200
+
+=== TEST 27: gzip post
+--- config
+location / {
+    basic_rule ARGS regex:script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- more_headers
+Content-Type: application/x-www-form-urlencoded
+Content-Encoding: gzip
+--- request eval
+use IO::Compress::Gzip qw(gzip);
+my $body;
+gzip \"foo1=bar1&foo2=%3Cscript%3E" => \$body;
+"POST /
+$body"
+--- error_code: 412
+
+=== TEST 28: header rules block a post before its body is read
+--- config
+location / {
+    basic_rule REQUEST_PATH_NORMALIZED str:/admin phase:1 id:1101 msg:test gids:ACL lev:LOG|BLOCK;
+    basic_rule ARGS regex:script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- more_headers
+Content-Type: application/x-www-form-urlencoded
+--- request eval
+"POST /admin/
+foo1=bar1&foo2=bar2"
+--- error_code: 412
+
+=== TEST 29: PROCESS_BODY_ERROR read before the body, then after it
+--- config
+location / {
+    basic_rule PROCESS_BODY_ERROR eq:1 phase:1 id:1001 msg:test gids:FORMAT lev:LOG|BLOCK;
+    basic_rule PROCESS_BODY_ERROR eq:1 phase:2 id:1002 msg:test gids:FORMAT lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- more_headers
+Content-Type: application/json
+--- request eval
+"POST /
+{\"user\": \"foo\""
+--- error_code: 412
+
+=== TEST 30: a location with response rules only doesn't read the request body
+--- config
+location / {
+    client_body_timeout 1s;
+    basic_rule $sent_http_content_type str:script phase:3 id:1001 msg:test gids:XSS lev:LOG;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- raw_request eval
+"POST / HTTP/1.0\r
+Host: localhost\r
+Content-Type: application/x-www-form-urlencoded\r
+Content-Length: 1024\r
+\r
+foo1=bar1"
+--- error_code: 200
+--- timeout: 5
+
+=== TEST 31: arguments past the body inspect limit are not inspected
+--- config
+location / {
+    body_inspect_limit 20;
+    basic_rule ARGS regex:script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- more_headers
+Content-Type: application/x-www-form-urlencoded
+--- request eval
+"POST /
+foo1=bar1&foo2=bar2&foo3=<script>"
+--- error_code: 200
+
+=== TEST 32: BODY_TRUNCATED is set when the body inspect limit is hit
+--- config
+location / {
+    body_inspect_limit_type application/x-www-form-urlencoded 20;
+    basic_rule BODY_TRUNCATED eq:1 phase:2 id:1002 msg:test gids:LIMIT lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- more_headers
+Content-Type: application/x-www-form-urlencoded
+--- request eval
+"POST /
+foo1=bar1&foo2=bar2&foo3=bar3"
+--- error_code: 412
+
+=== TEST 33: too many arguments
+--- config
+location / {
+    args_max_count 2;
+    basic_rule PROCESS_BODY_ERROR eq:1 phase:2 id:1001 msg:test gids:LIMIT lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request
+GET /?a=1&b=2&c=3
+--- error_code: 412
+
+=== TEST 34: an argument value over args_max_value_length
+--- config
+location / {
+    args_max_value_length 8;
+    basic_rule PROCESS_BODY_ERROR eq:1 phase:2 id:1001 msg:test gids:LIMIT lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- more_headers
+Content-Type: application/x-www-form-urlencoded
+--- request eval
+"POST /
+foo1=bar1&foo2=barbarbarbar"
+--- error_code: 412
+
+=== TEST 35: a streamed argument longer than the args_max_* limits
+--- config
+location / {
+    body_streaming on;
+    args_max_name_length 8;
+    args_max_value_length 16;
+    basic_rule PROCESS_BODY_ERROR eq:1 phase:2 id:1001 msg:test gids:LIMIT lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- more_headers
+Content-Type: application/x-www-form-urlencoded
+--- request eval
+"POST /
+foo1=bar1&foo2=" . ("x" x 4096)
+--- error_code: 412
+--- skip_nginx: 1: < 1.8.0
+
+=== TEST 36: argument names colliding in a php hash table
+--- config
+location / {
+    basic_rule ARGS_HASH_COLLISIONS gt:8 phase:2 id:1001 msg:test gids:HASHDOS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- request eval
+"GET /?" . join("&", map { my $i = $_; join("", map { ($i >> $_) & 1 ? "Ez" : "FY" } 0 .. 3) . "=1" } 0 .. 15)
+--- error_code: 412
+
+=== TEST 37: REQUEST_COOKIES:key
+--- config
+location / {
+    basic_rule REQUEST_COOKIES:session str:script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- more_headers
+Cookie: lang=en; session=<script>
+--- request
+GET /
+--- error_code: 412
+
+=== TEST 38: REQUEST_COOKIES:key, other cookies are not checked
+--- config
+location / {
+    basic_rule REQUEST_COOKIES:session str:script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- more_headers
+Cookie: lang=<script>; session=abc
+--- request
+GET /
+--- error_code: 200
+
+=== TEST 39: REQUEST_HEADERS:key, the name is case-insensitive
+--- config
+location / {
+    basic_rule REQUEST_HEADERS:x-forwarded-host str:script phase:1 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+}
+--- more_headers
+X-Forwarded-Host: <script>
+--- request
+GET /
+--- error_code: 412
+
+=== TEST 40: body_type maps another media type to a parser
+--- config
+location / {
+    body_type text/plain urlencoded;
+    basic_rule ARGS str:script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- more_headers
+Content-Type: text/plain
+--- request eval
+"POST /
+foo1=bar1&foo2=<script>"
+--- error_code: 412
+
+=== TEST 41: body_type none, the body isn't parsed
+--- config
+location / {
+    body_type application/x-www-form-urlencoded none;
+    basic_rule ARGS str:script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- more_headers
+Content-Type: application/x-www-form-urlencoded
+--- request eval
+"POST /
+foo1=bar1&foo2=<script>"
+--- error_code: 200
+
+=== TEST 42: body_type of a location keeps those of the server
+--- config
+body_type text/plain urlencoded;
+location / {
+    body_type application/csp-report json;
+    basic_rule ARGS str:script phase:2 id:1001 msg:test gids:XSS lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- more_headers
+Content-Type: text/plain
+--- request eval
+"POST /
+foo1=bar1&foo2=<script>"
+--- error_code: 412
+
+=== TEST 43: RESPONSE_BODY is checked as the response is sent
+--- config
+location / {
+    basic_rule RESPONSE_BODY str:mysql_fetch_array phase:4 id:1001 msg:test gids:LEAK lev:LOG;
+    default_type text/plain;
+    return 200 "Warning: mysql_fetch_array() expects parameter 1";
+}
+--- request
+GET /
+--- error_code: 200
+--- error_log
+[ysec_waf] alert, id: 1001
+
+=== TEST 44: RESPONSE_BODY with a tfn, matched in a later buffer of a proxied response
+--- user_files eval
+">>> big.txt\n" . ("a" x 4000) . "%3Cscript%3E" . ("b" x 1000)
+--- config
+location /backend/ {
+    yy_sec_waf off;
+    alias $TEST_NGINX_SERVROOT/html/;
+}
+location / {
+    basic_rule RESPONSE_BODY str:<script t:urldecode phase:4 id:1001 msg:test gids:XSS lev:LOG;
+    proxy_pass http://127.0.0.1:$TEST_NGINX_SERVER_PORT/backend/;
+    proxy_buffering off;
+    proxy_buffer_size 1k;
+}
+--- request
+GET /big.txt
+--- error_code: 200
+--- error_log
+[ysec_waf] alert, id: 1001
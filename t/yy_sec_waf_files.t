@@ -128,3 +128,181 @@ Content-Type: application/x-httpd-php\r
 "
 --- error_code: 412
 
+=== TEST 4: multipart, names are checked one by one
+--- user_files
+>>> foobar
+eh yo
+--- config
+location / {
+    basic_rule MULTIPART_NAME str:textdata "msg:uncommon name" phase:2 id:1202 gids:UPLOAD lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- raw_request eval
+my $body = "-----------------------------1919886344942015258287623957\r
+Content-Disposition: form-data; name=\"text\"\r
+\r
+valid text\r
+-----------------------------1919886344942015258287623957\r
+Content-Disposition: form-data; name=\"data\"\r
+\r
+more text\r
+-----------------------------1919886344942015258287623957--\r
+";
+"POST /foobar HTTP/1.1\r
+Host: 127.0.0.1\r
+Connection: Close\r
+Content-Type: multipart/form-data; boundary=---------------------------1919886344942015258287623957\r
+Content-Length: " . length($body) . "\r
+\r
+" . $body
+--- error_code: 200
+
+=== TEST 5: multipart, no closing delimiter
+--- user_files
+>>> foobar
+eh yo
+--- config
+location / {
+    basic_rule PROCESS_BODY_ERROR eq:1 "msg:bad body" phase:2 id:1203 gids:UPLOAD lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- raw_request eval
+my $body = "--XyZ\r
+Content-Disposition: form-data; name=\"datafile\"; filename=\"bla.txt\"\r
+Content-Type: text/plain\r
+\r
+\0\0\r\0\r\n-\r\n--XyQ\r
+";
+"POST /foobar HTTP/1.1\r
+Host: 127.0.0.1\r
+Connection: Close\r
+Content-Type: multipart/form-data; boundary=XyZ\r
+Content-Length: " . length($body) . "\r
+\r
+" . $body
+--- error_code: 412
+
+=== TEST 6: multipart, part headers and part bodies
+--- user_files
+>>> foobar
+eh yo
+--- config
+location / {
+    basic_rule MULTIPART_PART_HEADERS:content-transfer-encoding regex:base64 "msg:encoded part" phase:2 id:1204 gids:UPLOAD lev:LOG;
+    basic_rule MULTIPART_PART_BODY:datafile "regex:<\?php" "msg:php in file" phase:2 id:1205 gids:UPLOAD lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- raw_request eval
+my $body = "--XyZ\r
+Content-Disposition: form-data; name=\"textline\"\r
+Content-Transfer-Encoding: base64\r
+\r
+PD9waHA=\r
+--XyZ\r
+Content-Disposition: form-data; name=\"datafile\"; filename=\"bla.txt\"\r
+Content-Type: text/plain\r
+\r
+<?php system(\$_GET['c']); ?>\r
+--XyZ--\r
+";
+"POST /foobar HTTP/1.1\r
+Host: 127.0.0.1\r
+Connection: Close\r
+Content-Type: multipart/form-data; boundary=XyZ\r
+Content-Length: " . length($body) . "\r
+\r
+" . $body
+--- error_code: 412
+
+=== TEST 7: multipart, file type by the first bytes
+--- user_files
+>>> foobar
+eh yo
+--- config
+location / {
+    basic_rule MULTIPART_FILE_TYPE "regex:^(php|elf|pe)$" "msg:uncommon file" phase:2 id:1206 gids:UPLOAD lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- raw_request eval
+my $body = "--XyZ\r
+Content-Disposition: form-data; name=\"datafile\"; filename=\"bla.gif\"\r
+Content-Type: image/gif\r
+\r
+GIF89a\x01\x00\x01\x00<?php system(\$_GET['c']); ?>\r
+--XyZ--\r
+";
+"POST /foobar HTTP/1.1\r
+Host: 127.0.0.1\r
+Connection: Close\r
+Content-Type: multipart/form-data; boundary=XyZ\r
+Content-Length: " . length($body) . "\r
+\r
+" . $body
+--- error_code: 412
+
+=== TEST 8: multipart, extension not in the upload_filter allow table
+--- user_files
+>>> foobar
+eh yo
+--- config
+location / {
+    upload_filter extension allow jpg png gif;
+    upload_filter content_type deny text/html;
+    basic_rule PROCESS_BODY_ERROR eq:1 "msg:bad body" phase:2 id:1203 gids:UPLOAD lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- raw_request eval
+my $body = "--XyZ\r
+Content-Disposition: form-data; name=\"datafile\"; filename=\"bla.PnG.shtml. \"\r
+Content-Type: image/png\r
+\r
+buibuibubi\r
+--XyZ--\r
+";
+"POST /foobar HTTP/1.1\r
+Host: 127.0.0.1\r
+Connection: Close\r
+Content-Type: multipart/form-data; boundary=XyZ\r
+Content-Length: " . length($body) . "\r
+\r
+" . $body
+--- error_code: 412
+
+=== TEST 9: multipart, the default extensions are allowed with deny off
+--- user_files
+>>> foobar
+eh yo
+--- config
+location / {
+    upload_filter extension deny off;
+    basic_rule PROCESS_BODY_ERROR eq:1 "msg:bad body" phase:2 id:1203 gids:UPLOAD lev:LOG|BLOCK;
+    root $TEST_NGINX_SERVROOT/html/;
+    index index.html index.htm;
+    error_page 405 = $uri;
+}
+--- raw_request eval
+my $body = "--XyZ\r
+Content-Disposition: form-data; name=\"datafile\"; filename=\"bla.php\"\r
+Content-Type: application/octet-stream\r
+\r
+buibuibubi\r
+--XyZ--\r
+";
+"POST /foobar HTTP/1.1\r
+Host: 127.0.0.1\r
+Connection: Close\r
+Content-Type: multipart/form-data; boundary=XyZ\r
+Content-Length: " . length($body) . "\r
+\r
+" . $body
+--- error_code: 200